@@ -37,6 +37,38 @@
 
 #include "Descriptors.h"
 
+/* Expand X once for each cable the streaming interface declares. */
+#if (MIDI_CABLES == 16)
+	#define FOR_EACH_CABLE(X)  X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7) \
+	                           X(8) X(9) X(10) X(11) X(12) X(13) X(14) X(15)
+#else
+	#define FOR_EACH_CABLE(X)  X(0)
+#endif
+
+#define IN_JACK_EMB(c)                                                                                        \
+	{                                                                                                         \
+		.Header                   = {.Size = sizeof(USB_MIDI_Descriptor_InputJack_t), .Type = DTYPE_CSInterface}, \
+		.Subtype                  = AUDIO_DSUBTYPE_CSInterface_InputTerminal,                                 \
+		.JackType                 = MIDI_JACKTYPE_Embedded,                                                   \
+		.JackID                   = MIDI_JACK_IN_EMB(c),                                                      \
+		.JackStrIndex             = NO_DESCRIPTOR                                                             \
+	},
+
+#define OUT_JACK_EMB(c)                                                                                       \
+	{                                                                                                         \
+		.Header                   = {.Size = sizeof(USB_MIDI_Descriptor_OutputJack_t), .Type = DTYPE_CSInterface}, \
+		.Subtype                  = AUDIO_DSUBTYPE_CSInterface_OutputTerminal,                                \
+		.JackType                 = MIDI_JACKTYPE_Embedded,                                                   \
+		.JackID                   = MIDI_JACK_OUT_EMB(c),                                                     \
+		.NumberOfPins             = 1,                                                                        \
+		.SourceJackID             = {MIDI_JACK_IN_EXT},                                                       \
+		.SourcePinID              = {0x01},                                                                   \
+		.JackStrIndex             = NO_DESCRIPTOR                                                             \
+	},
+
+#define IN_JACK_EMB_ID(c)   MIDI_JACK_IN_EMB(c),
+#define OUT_JACK_EMB_ID(c)  MIDI_JACK_OUT_EMB(c),
+
 /** Device descriptor structure. This descriptor, located in FLASH memory, describes the overall
  *  device characteristics, including the supported USB version, control endpoint size and the
  *  number of device configurations. The descriptor is read out by the USB host when the enumeration
@@ -54,8 +86,8 @@ USB_Descriptor_Device_t PROGMEM DeviceDescriptor =
 	.Endpoint0Size          = FIXED_CONTROL_ENDPOINT_SIZE,
 
 	.VendorID               = 0x03EB,
-	.ProductID              = 0x2048,
-	.ReleaseNumber          = VERSION_BCD(00.01),
+	.ProductID              = MIDI_PRODUCT_ID,
+	.ReleaseNumber          = MIDI_RELEASE_BCD,
 
 	.ManufacturerStrIndex   = 0x01,
 	.ProductStrIndex        = 0x02,
@@ -137,20 +169,11 @@ USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor =
 
 			.AudioSpecification       = VERSION_BCD(01.00),
 
-			.TotalLength              = (sizeof(USB_Descriptor_Configuration_t) -
+			.TotalLength              = (offsetof(USB_Descriptor_Configuration_t, UMP_StreamInterface) -
 			                             offsetof(USB_Descriptor_Configuration_t, Audio_StreamInterface_SPC))
 		},
 
-	.MIDI_In_Jack_Emb =
-		{
-			.Header                   = {.Size = sizeof(USB_MIDI_Descriptor_InputJack_t), .Type = DTYPE_CSInterface},
-			.Subtype                  = AUDIO_DSUBTYPE_CSInterface_InputTerminal,
-
-			.JackType                 = MIDI_JACKTYPE_Embedded,
-			.JackID                   = 0x01,
-
-			.JackStrIndex             = NO_DESCRIPTOR
-		},
+	.MIDI_In_Jack_Emb         = {FOR_EACH_CABLE(IN_JACK_EMB)},
 
 	.MIDI_In_Jack_Ext =
 		{
@@ -158,25 +181,12 @@ USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor =
 			.Subtype                  = AUDIO_DSUBTYPE_CSInterface_InputTerminal,
 
 			.JackType                 = MIDI_JACKTYPE_External,
-			.JackID                   = 0x02,
+			.JackID                   = MIDI_JACK_IN_EXT,
 
 			.JackStrIndex             = NO_DESCRIPTOR
 		},
 
-	.MIDI_Out_Jack_Emb =
-		{
-			.Header                   = {.Size = sizeof(USB_MIDI_Descriptor_OutputJack_t), .Type = DTYPE_CSInterface},
-			.Subtype                  = AUDIO_DSUBTYPE_CSInterface_OutputTerminal,
-
-			.JackType                 = MIDI_JACKTYPE_Embedded,
-			.JackID                   = 0x03,
-
-			.NumberOfPins             = 1,
-			.SourceJackID             = {0x02},
-			.SourcePinID              = {0x01},
-
-			.JackStrIndex             = NO_DESCRIPTOR
-		},
+	.MIDI_Out_Jack_Emb        = {FOR_EACH_CABLE(OUT_JACK_EMB)},
 
 	.MIDI_Out_Jack_Ext =
 		{
@@ -184,10 +194,10 @@ USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor =
 			.Subtype                  = AUDIO_DSUBTYPE_CSInterface_OutputTerminal,
 
 			.JackType                 = MIDI_JACKTYPE_External,
-			.JackID                   = 0x04,
+			.JackID                   = MIDI_JACK_OUT_EXT,
 
 			.NumberOfPins             = 1,
-			.SourceJackID             = {0x01},
+			.SourceJackID             = {MIDI_JACK_IN_EMB(0)},
 			.SourcePinID              = {0x01},
 
 			.JackStrIndex             = NO_DESCRIPTOR
@@ -211,11 +221,11 @@ USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor =
 
 	.MIDI_In_Jack_Endpoint_SPC =
 		{
-			.Header                   = {.Size = sizeof(USB_MIDI_Descriptor_Jack_Endpoint_t), .Type = DTYPE_CSEndpoint},
+			.Header                   = {.Size = sizeof(USB_MIDI_Descriptor_Jacks_Endpoint_t), .Type = DTYPE_CSEndpoint},
 			.Subtype                  = AUDIO_DSUBTYPE_CSEndpoint_General,
 
-			.TotalEmbeddedJacks       = 0x01,
-			.AssociatedJackID         = {0x01}
+			.TotalEmbeddedJacks       = MIDI_CABLES,
+			.AssociatedJackID         = {FOR_EACH_CABLE(IN_JACK_EMB_ID)}
 		},
 
 	.MIDI_Out_Jack_Endpoint =
@@ -236,11 +246,105 @@ USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor =
 
 	.MIDI_Out_Jack_Endpoint_SPC =
 		{
-			.Header                   = {.Size = sizeof(USB_MIDI_Descriptor_Jack_Endpoint_t), .Type = DTYPE_CSEndpoint},
+			.Header                   = {.Size = sizeof(USB_MIDI_Descriptor_Jacks_Endpoint_t), .Type = DTYPE_CSEndpoint},
 			.Subtype                  = AUDIO_DSUBTYPE_CSEndpoint_General,
 
-			.TotalEmbeddedJacks       = 0x01,
-			.AssociatedJackID         = {0x03}
+			.TotalEmbeddedJacks       = MIDI_CABLES,
+			.AssociatedJackID         = {FOR_EACH_CABLE(OUT_JACK_EMB_ID)}
+		},
+
+	.UMP_StreamInterface =
+		{
+			.Header                   = {.Size = sizeof(USB_Descriptor_Interface_t), .Type = DTYPE_Interface},
+
+			.InterfaceNumber          = 1,
+			.AlternateSetting         = MIDI_STREAM_UMP_ALTSETTING,
+
+			.TotalEndpoints           = 2,
+
+			.Class                    = AUDIO_CSCP_AudioClass,
+			.SubClass                 = AUDIO_CSCP_MIDIStreamingSubclass,
+			.Protocol                 = AUDIO_CSCP_StreamingProtocol,
+
+			.InterfaceStrIndex        = NO_DESCRIPTOR
+		},
+
+	.UMP_StreamInterface_SPC =
+		{
+			.Header                   = {.Size = sizeof(USB_MIDI_Descriptor_AudioInterface_AS_t), .Type = DTYPE_CSInterface},
+			.Subtype                  = AUDIO_DSUBTYPE_CSInterface_General,
+
+			.AudioSpecification       = VERSION_BCD(02.00),
+
+			.TotalLength              = sizeof(USB_MIDI_Descriptor_AudioInterface_AS_t)
+		},
+
+	.UMP_Out_Endpoint =
+		{
+			.Header                   = {.Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint},
+
+			.EndpointAddress          = (ENDPOINT_DESCRIPTOR_DIR_OUT | MIDI_STREAM_OUT_EPNUM),
+			.Attributes               = (EP_TYPE_BULK | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
+			.EndpointSize             = MIDI_STREAM_EPSIZE,
+			.PollingIntervalMS        = 0x01
+		},
+
+	.UMP_Out_Endpoint_SPC =
+		{
+			.Header                   = {.Size = sizeof(USB_MIDI2_Descriptor_Endpoint_t), .Type = DTYPE_CSEndpoint},
+			.Subtype                  = MIDI2_DSUBTYPE_CSEndpoint_General,
+
+			.TotalGroupTerminalBlocks = 0x01,
+			.AssociatedGroupTerminalBlockID = {0x01}
+		},
+
+	.UMP_In_Endpoint =
+		{
+			.Header                   = {.Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint},
+
+			.EndpointAddress          = (ENDPOINT_DESCRIPTOR_DIR_IN | MIDI_STREAM_IN_EPNUM),
+			.Attributes               = (EP_TYPE_BULK | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
+			.EndpointSize             = MIDI_STREAM_EPSIZE,
+			.PollingIntervalMS        = 0x01
+		},
+
+	.UMP_In_Endpoint_SPC =
+		{
+			.Header                   = {.Size = sizeof(USB_MIDI2_Descriptor_Endpoint_t), .Type = DTYPE_CSEndpoint},
+			.Subtype                  = MIDI2_DSUBTYPE_CSEndpoint_General,
+
+			.TotalGroupTerminalBlocks = 0x01,
+			.AssociatedGroupTerminalBlockID = {0x01}
+		}
+};
+
+/** Group Terminal Block descriptors of the UMP alternate setting. A single bidirectional block covers the one
+ *  group which maps onto the serial port, and speaks MIDI 1.0 messages with JR Timestamps at serial MIDI
+ *  bandwidth. That group follows the configured cable, so FirstGroup is filled in when the host asks.
+ */
+USB_Descriptor_GroupTerminalBlocks_t PROGMEM GroupTerminalBlocks =
+{
+	.Header =
+		{
+			.Header                   = {.Size = sizeof(USB_MIDI2_Descriptor_GroupTerminalBlockHeader_t), .Type = MIDI2_DTYPE_CSGroupTerminalBlock},
+			.Subtype                  = MIDI2_DSUBTYPE_GroupTerminalBlockHeader,
+
+			.TotalLength              = sizeof(USB_Descriptor_GroupTerminalBlocks_t)
+		},
+
+	.Block =
+		{
+			.Header                   = {.Size = sizeof(USB_MIDI2_Descriptor_GroupTerminalBlock_t), .Type = MIDI2_DTYPE_CSGroupTerminalBlock},
+			.Subtype                  = MIDI2_DSUBTYPE_GroupTerminalBlock,
+
+			.GroupTerminalBlockID     = 0x01,
+			.GroupTerminalBlockType   = MIDI2_GTB_TYPE_Bidirectional,
+			.FirstGroup               = 0x00,
+			.TotalGroups              = 0x01,
+			.BlockStrIndex            = NO_DESCRIPTOR,
+			.MIDIProtocol             = MIDI2_GTB_PROTOCOL_MIDI10_64_JRTS,
+			.MaxInputBandwidth        = 0x0001,
+			.MaxOutputBandwidth       = 0x0001
 		}
 };
 
@@ -42,6 +42,21 @@
         #include <avr/pgmspace.h>
 
     /* Macros: */
+        /** USB product ID of the bridge, which its Identity Reply also gives as the device family. */
+        #define MIDI_PRODUCT_ID             0x2048
+
+        /** Major part of the bridge's release number, 0 to 99. */
+        #define MIDI_RELEASE_MAJOR          0
+
+        /** Minor part of the bridge's release number, 0 to 99. */
+        #define MIDI_RELEASE_MINOR          1
+
+        /** Release number of the bridge in the BCD form of the device descriptor. The Identity Reply
+         *  gives the two parts as they are, which keeps them 7-bit clean.
+         */
+        #define MIDI_RELEASE_BCD            (((MIDI_RELEASE_MAJOR / 10) << 12) | ((MIDI_RELEASE_MAJOR % 10) << 8) | \
+                                             ((MIDI_RELEASE_MINOR / 10) << 4)  |  (MIDI_RELEASE_MINOR % 10))
+
         /** Endpoint number of the MIDI streaming data IN endpoint, for device-to-host data transfers. */
         #define MIDI_STREAM_IN_EPNUM        2
 
@@ -51,7 +66,112 @@
         /** Endpoint size in bytes of the Audio isochronous streaming data IN and OUT endpoints. */
         #define MIDI_STREAM_EPSIZE          64
 
+        /** Number of cables (virtual MIDI ports) the USB-MIDI 1.0 streaming interface declares, each with
+         *  an embedded IN and OUT jack. Link mode carries all 16 cable numbers to the main MCU, and
+         *  merge mode forwards all 16 to the serial port.
+         */
+        #if defined(LINK_MODE) || defined(MERGE_CABLES)
+            #define MIDI_CABLES             16
+        #else
+            #define MIDI_CABLES             1
+        #endif
+
+        /** Jack ID of the embedded IN jack of a cable, fed by the OUT endpoint. */
+        #define MIDI_JACK_IN_EMB(c)         (0x01 + (c))
+
+        /** Jack ID of the embedded OUT jack of a cable, feeding the IN endpoint. */
+        #define MIDI_JACK_OUT_EMB(c)        (0x01 + MIDI_CABLES + (c))
+
+        /** Jack ID of the external IN jack, the serial port input. */
+        #define MIDI_JACK_IN_EXT            (0x01 + 2 * MIDI_CABLES)
+
+        /** Jack ID of the external OUT jack, the serial port output. */
+        #define MIDI_JACK_OUT_EXT           (0x02 + 2 * MIDI_CABLES)
+
+        /** Alternate setting of the MIDI streaming interface which carries Universal MIDI Packets. */
+        #define MIDI_STREAM_UMP_ALTSETTING  1
+
+        /** Descriptor type of the USB MIDI 2.0 class specific Group Terminal Block descriptors. */
+        #define MIDI2_DTYPE_CSGroupTerminalBlock         0x26
+
+        /** Descriptor subtype of the Group Terminal Block header descriptor. */
+        #define MIDI2_DSUBTYPE_GroupTerminalBlockHeader  0x01
+
+        /** Descriptor subtype of a Group Terminal Block descriptor. */
+        #define MIDI2_DSUBTYPE_GroupTerminalBlock        0x02
+
+        /** Descriptor subtype of the USB MIDI 2.0 class specific endpoint descriptor. */
+        #define MIDI2_DSUBTYPE_CSEndpoint_General        0x02
+
+        /** Group Terminal Block type for blocks which carry data in both directions. */
+        #define MIDI2_GTB_TYPE_Bidirectional             0x00
+
+        /** Group Terminal Block protocol value for MIDI 1.0 messages of up to 64 bits. */
+        #define MIDI2_GTB_PROTOCOL_MIDI10_64             0x01
+
+        /** Group Terminal Block protocol value for MIDI 1.0 messages of up to 64 bits, with JR Timestamps. */
+        #define MIDI2_GTB_PROTOCOL_MIDI10_64_JRTS        0x02
+
     /* Type Defines: */
+        /** Type define for a MIDI class specific streaming endpoint descriptor which lists the embedded
+         *  jacks of all \ref MIDI_CABLES cables.
+         */
+        typedef struct
+        {
+            USB_Descriptor_Header_t Header;
+            uint8_t                 Subtype;
+
+            uint8_t                 TotalEmbeddedJacks;
+            uint8_t                 AssociatedJackID[MIDI_CABLES];
+        } USB_MIDI_Descriptor_Jacks_Endpoint_t;
+
+        /** Type define for a USB MIDI 2.0 class specific endpoint descriptor, which lists the Group Terminal
+         *  Blocks an endpoint of the UMP alternate setting is associated with.
+         */
+        typedef struct
+        {
+            USB_Descriptor_Header_t Header;
+            uint8_t                 Subtype;
+
+            uint8_t                 TotalGroupTerminalBlocks;
+            uint8_t                 AssociatedGroupTerminalBlockID[1];
+        } USB_MIDI2_Descriptor_Endpoint_t;
+
+        /** Type define for the Group Terminal Block header descriptor. */
+        typedef struct
+        {
+            USB_Descriptor_Header_t Header;
+            uint8_t                 Subtype;
+
+            uint16_t                TotalLength;
+        } USB_MIDI2_Descriptor_GroupTerminalBlockHeader_t;
+
+        /** Type define for a Group Terminal Block descriptor, which describes a range of UMP groups. */
+        typedef struct
+        {
+            USB_Descriptor_Header_t Header;
+            uint8_t                 Subtype;
+
+            uint8_t                 GroupTerminalBlockID;
+            uint8_t                 GroupTerminalBlockType;
+            uint8_t                 FirstGroup;
+            uint8_t                 TotalGroups;
+            uint8_t                 BlockStrIndex;
+            uint8_t                 MIDIProtocol;
+            uint16_t                MaxInputBandwidth;
+            uint16_t                MaxOutputBandwidth;
+        } USB_MIDI2_Descriptor_GroupTerminalBlock_t;
+
+        /** Type define for the Group Terminal Block descriptors of the UMP alternate setting. These are
+         *  not part of the configuration descriptor, but are requested separately by MIDI 2.0 hosts,
+         *  and are answered from the streaming interface's control request handler.
+         */
+        typedef struct
+        {
+            USB_MIDI2_Descriptor_GroupTerminalBlockHeader_t Header;
+            USB_MIDI2_Descriptor_GroupTerminalBlock_t       Block;
+        } USB_Descriptor_GroupTerminalBlocks_t;
+
         /** Type define for the device configuration descriptor structure. This must be defined in the
          *  application code, as the configuration descriptor contains several sub-descriptors which
          *  vary between devices, and which describe the device's usage to the host.
@@ -63,16 +183,25 @@
             USB_Audio_Descriptor_Interface_AC_t       Audio_ControlInterface_SPC;
             USB_Descriptor_Interface_t                Audio_StreamInterface;
             USB_MIDI_Descriptor_AudioInterface_AS_t   Audio_StreamInterface_SPC;
-            USB_MIDI_Descriptor_InputJack_t           MIDI_In_Jack_Emb;
+            USB_MIDI_Descriptor_InputJack_t           MIDI_In_Jack_Emb[MIDI_CABLES];
             USB_MIDI_Descriptor_InputJack_t           MIDI_In_Jack_Ext;
-            USB_MIDI_Descriptor_OutputJack_t          MIDI_Out_Jack_Emb;
+            USB_MIDI_Descriptor_OutputJack_t          MIDI_Out_Jack_Emb[MIDI_CABLES];
             USB_MIDI_Descriptor_OutputJack_t          MIDI_Out_Jack_Ext;
             USB_Audio_Descriptor_StreamEndpoint_Std_t MIDI_In_Jack_Endpoint;
-            USB_MIDI_Descriptor_Jack_Endpoint_t       MIDI_In_Jack_Endpoint_SPC;
+            USB_MIDI_Descriptor_Jacks_Endpoint_t      MIDI_In_Jack_Endpoint_SPC;
             USB_Audio_Descriptor_StreamEndpoint_Std_t MIDI_Out_Jack_Endpoint;
-            USB_MIDI_Descriptor_Jack_Endpoint_t       MIDI_Out_Jack_Endpoint_SPC;
+            USB_MIDI_Descriptor_Jacks_Endpoint_t      MIDI_Out_Jack_Endpoint_SPC;
+            USB_Descriptor_Interface_t                UMP_StreamInterface;
+            USB_MIDI_Descriptor_AudioInterface_AS_t   UMP_StreamInterface_SPC;
+            USB_Descriptor_Endpoint_t                 UMP_Out_Endpoint;
+            USB_MIDI2_Descriptor_Endpoint_t           UMP_Out_Endpoint_SPC;
+            USB_Descriptor_Endpoint_t                 UMP_In_Endpoint;
+            USB_MIDI2_Descriptor_Endpoint_t           UMP_In_Endpoint_SPC;
         } USB_Descriptor_Configuration_t;
 
+    /* External Variables: */
+        extern USB_Descriptor_GroupTerminalBlocks_t PROGMEM GroupTerminalBlocks;
+
     /* Function Prototypes: */
         uint16_t CALLBACK_USB_GetDescriptor(const uint16_t wValue,
                                             const uint8_t wIndex,
@@ -0,0 +1,119 @@
+/*
+ * USB-MIDI <-> Serial MIDI converter.
+ *
+ * This software is Copyright (c) 2011 by Florian Ragwitz.
+ *
+ * This is free software, licensed under:
+ *   The GNU General Public License, Version 2, June 1991
+ */
+
+/** \file
+ *
+ *  Circular trace of compact event records, which can be frozen some number of
+ *  records after a trigger record so the events around a glitch are kept.
+ */
+
+#ifndef _EVENT_TRACE_H_
+#define _EVENT_TRACE_H_
+
+	/* Includes: */
+		#include <stdint.h>
+		#include <stdbool.h>
+		#include <string.h>
+
+	/* Defines: */
+		#if !defined(TRACE_SIZE) || defined(__DOXYGEN__)
+			/** Number of records in the trace - must be a power of two no larger than 128. Can be
+			 *  overridden by defining it before this header is included.
+			 */
+			#define TRACE_SIZE      32
+		#endif
+
+	/* Type Defines: */
+		/** Type define for a single trace record. */
+		typedef struct
+		{
+			uint16_t Time;  /**< Low 16 bits of the timestamp of the record. */
+			uint8_t  Kind;  /**< Kind of the record in the low nibble, the caller may use the high nibble. */
+			uint8_t  Value; /**< Value of the record, meaning depends on the kind. */
+		} TraceEntry_t;
+
+		/** Type define for a trace. Traces should be initialized via a call to \ref Trace_Arm() before use. */
+		typedef struct
+		{
+			TraceEntry_t Entries[TRACE_SIZE]; /**< Records, oldest at Head once the trace has wrapped. */
+			uint8_t      Head; /**< Where the next record will be stored. */
+			uint8_t      TriggerKind; /**< Record kind which triggers the trace, or 0 for none. */
+			uint8_t      TriggerValue; /**< Value a trigger record must have, after masking. */
+			uint8_t      TriggerMask; /**< Bits of the value compared against TriggerValue. */
+			uint8_t      Remaining; /**< Records still to be stored after the trigger. */
+			bool         Triggered; /**< Whether the trigger record has been seen. */
+			bool         Frozen; /**< Whether recording has stopped. */
+		} Trace_t;
+
+	/* Inline Functions: */
+		/** Clears a trace and arms its trigger. The trace freezes once PostTrigger records have
+		 *  been stored after the first record of kind TriggerKind whose value matches.
+		 *
+		 *  \param[out] Trace        Pointer to a trace structure to initialize
+		 *  \param[in]  TriggerKind  Record kind to trigger on, or 0 to record until re-armed
+		 *  \param[in]  TriggerValue Value the trigger record must have, after masking
+		 *  \param[in]  TriggerMask  Bits of the value to compare
+		 *  \param[in]  PostTrigger  Number of records to store after the trigger record
+		 */
+		static inline void Trace_Arm(Trace_t* const Trace,
+		                             const uint8_t TriggerKind,
+		                             const uint8_t TriggerValue,
+		                             const uint8_t TriggerMask,
+		                             const uint8_t PostTrigger)
+		{
+			memset(Trace, 0, sizeof(Trace_t));
+			Trace->TriggerKind  = TriggerKind;
+			Trace->TriggerValue = (TriggerValue & TriggerMask);
+			Trace->TriggerMask  = TriggerMask;
+			Trace->Remaining    = PostTrigger;
+		}
+
+		/** Stores a record in the trace, unless it is frozen. Takes a bounded number of cycles.
+		 *
+		 *  \param[in,out] Trace  Pointer to a trace structure to record into
+		 *  \param[in]     Time   Timestamp of the record
+		 *  \param[in]     Kind   Kind of the record in the low nibble, free for the caller in the high nibble
+		 *  \param[in]     Value  Value of the record
+		 */
+		static inline void Trace_Record(Trace_t* const Trace,
+		                                const uint16_t Time,
+		                                const uint8_t Kind,
+		                                const uint8_t Value)
+		{
+			TraceEntry_t* Entry;
+
+			if (Trace->Frozen)
+			  return;
+
+			Entry        = &Trace->Entries[Trace->Head];
+			Entry->Time  = Time;
+			Entry->Kind  = Kind;
+			Entry->Value = Value;
+			Trace->Head  = ((Trace->Head + 1) & (TRACE_SIZE - 1));
+
+			if (!(Trace->Triggered))
+			{
+				if (((Kind & 0x0F) != Trace->TriggerKind) ||
+				    ((Value & Trace->TriggerMask) != Trace->TriggerValue))
+				{
+				  return;
+				}
+
+				Trace->Triggered = true;
+			}
+			else
+			{
+				Trace->Remaining--;
+			}
+
+			if (!(Trace->Remaining))
+			  Trace->Frozen = true;
+		}
+
+#endif
@@ -31,92 +31,88 @@
 /** \file
  *
  *  Ultra lightweight ring buffer, for fast insertion/deletion.
+ *
+ *  The buffers are single producer, single consumer: one execution thread (the main program
+ *  thread or an ISR) inserts, and one other thread removes. Each side only ever writes its own
+ *  8-bit index, and reading an 8-bit index is atomic on the AVR, so no critical sections are
+ *  needed on either side.
  */
  
 #ifndef _ULW_RING_BUFF_H_
 #define _ULW_RING_BUFF_H_
 
 	/* Includes: */
-		#include <util/atomic.h>
-	
+		#include <LUFA/Drivers/USB/USB.h>
+
 		#include <stdint.h>
 		#include <stdbool.h>
 
 	/* Defines: */
-		/** Size of each ring buffer, in data elements - must be between 1 and 255. */
-		#define BUFFER_SIZE         128
+		/** Size of each byte ring buffer, in data elements - must be a power of two no larger than 128. */
+		#define BUFFER_SIZE         32
 		
 		/** Maximum number of data elements to buffer before forcing a flush. 
 		 *  Must be less than BUFFER_SIZE
 		 */
-		#define BUFFER_NEARLY_FULL	96
-		
+		#define BUFFER_NEARLY_FULL	24
+
 		/** Type of data to store into the buffer. */
 		#define RingBuff_Data_t     uint8_t
 
 		/** Datatype which may be used to store the count of data stored in a buffer, retrieved
 		 *  via a call to \ref RingBuffer_GetCount().
 		 */
-		#if (BUFFER_SIZE <= 0xFF)
-			#define RingBuff_Count_t   uint8_t
-		#else
-			#define RingBuff_Count_t   uint16_t
+		#define RingBuff_Count_t    uint8_t
+
+		#if ((BUFFER_SIZE & (BUFFER_SIZE - 1)) || (BUFFER_SIZE > 128))
+			#error BUFFER_SIZE must be a power of two no larger than 128.
 		#endif
 
+		/** Keeps the compiler from moving memory accesses across an index access, so the other
+		 *  side never sees an index before the data it covers, and the consumer never reads data
+		 *  ahead of the check that found it stored.
+		 */
+		#define RINGBUFF_BARRIER()  __asm__ __volatile__ ("" ::: "memory")
+
 	/* Type Defines: */
 		/** Type define for a new ring buffer object. Buffers should be initialized via a call to
 		 *  \ref RingBuffer_InitBuffer() before use.
 		 */
 		typedef struct
 		{
-			RingBuff_Data_t  Buffer[BUFFER_SIZE]; /**< Internal ring buffer data, referenced by the buffer pointers. */
-			RingBuff_Data_t* In; /**< Current storage location in the circular buffer */
-			RingBuff_Data_t* Out; /**< Current retrieval location in the circular buffer */
-			RingBuff_Count_t Count;
+			RingBuff_Data_t  Buffer[BUFFER_SIZE]; /**< Internal ring buffer data, referenced by the buffer indexes. */
+			volatile uint8_t In; /**< Free running storage index, only written by the producer */
+			volatile uint8_t Out; /**< Free running retrieval index, only written by the consumer */
 		} RingBuff_t;
 	
 	/* Inline Functions: */
 		/** Initializes a ring buffer ready for use. Buffers must be initialized via this function
 		 *  before any operations are called upon them. Already initialized buffers may be reset
-		 *  by re-initializing them using this function.
+		 *  by re-initializing them using this function, as long as neither side is using them.
 		 *
 		 *  \param[out] Buffer  Pointer to a ring buffer structure to initialize
 		 */
 		static inline void RingBuffer_InitBuffer(RingBuff_t* const Buffer)
 		{
-			ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
-			{
-				Buffer->In  = Buffer->Buffer;
-				Buffer->Out = Buffer->Buffer;
-			}
+			Buffer->In  = 0;
+			Buffer->Out = 0;
 		}
 		
-		/** Retrieves the minimum number of bytes stored in a particular buffer. This value is computed
-		 *  by entering an atomic lock on the buffer while the IN and OUT locations are fetched, so that
-		 *  the buffer cannot be modified while the computation takes place. This value should be cached
-		 *  when reading out the contents of the buffer, so that as small a time as possible is spent
-		 *  in an atomic lock.
+		/** Retrieves the minimum number of bytes stored in a particular buffer. Both indexes are
+		 *  single bytes, so this needs no atomic lock.
 		 *
 		 *  \note The value returned by this function is guaranteed to only be the minimum number of bytes
-		 *        stored in the given buffer; this value may change as other threads write new data and so
-		 *        the returned number should be used only to determine how many successive reads may safely
-		 *        be performed on the buffer.
+		 *        stored in the given buffer when called by the consumer, or the maximum when called by
+		 *        the producer; the other side may change it at any time.
 		 *
 		 *  \param[in] Buffer  Pointer to a ring buffer structure whose count is to be computed
 		 */
 		static inline RingBuff_Count_t RingBuffer_GetCount(RingBuff_t* const Buffer)
 		{
-			RingBuff_Count_t Count;
-			
-			ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
-			{
-				Count = Buffer->Count;
-			}
-			
-			return Count;
+			return (uint8_t)(Buffer->In - Buffer->Out);
 		}
 		
-		/** Atomically determines if the specified ring buffer contains any free space. This should
+		/** Determines if the specified ring buffer contains any free space. This should
 		 *  be tested before storing data to the buffer, to ensure that no data is lost due to a
 		 *  buffer overrun.
 		 *
@@ -129,21 +125,17 @@
 			return (RingBuffer_GetCount(Buffer) == BUFFER_SIZE);
 		}
 
-		/** Atomically determines if the specified ring buffer contains any data. This should
+		/** Determines if the specified ring buffer contains any data. This should
 		 *  be tested before removing data from the buffer, to ensure that the buffer does not
 		 *  underflow.
 		 *
-		 *  If the data is to be removed in a loop, store the total number of bytes stored in the
-		 *  buffer (via a call to the \ref RingBuffer_GetCount() function) in a temporary variable
-		 *  to reduce the time spent in atomicity locks.
-		 *
 		 *  \param[in,out] Buffer  Pointer to a ring buffer structure to insert into
 		 *
-		 *  \return Boolean true if the buffer contains no free space, false otherwise
+		 *  \return Boolean true if the buffer contains no data, false otherwise
 		 */		 
 		static inline bool RingBuffer_IsEmpty(RingBuff_t* const Buffer)
 		{
-			return (RingBuffer_GetCount(Buffer) == 0);
+			return (Buffer->In == Buffer->Out);
 		}
 
 		/** Inserts an element into the ring buffer.
@@ -158,15 +150,31 @@
 		static inline void RingBuffer_Insert(RingBuff_t* const Buffer,
 		                                     const RingBuff_Data_t Data)
 		{
-			*Buffer->In = Data;
-			
-			if (++Buffer->In == &Buffer->Buffer[BUFFER_SIZE])
-			  Buffer->In = Buffer->Buffer;
+			uint8_t In = Buffer->In;
 
-			ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
-			{
-				Buffer->Count++;
-			}
+			Buffer->Buffer[In & (BUFFER_SIZE - 1)] = Data;
+			RINGBUFF_BARRIER();
+			Buffer->In = (In + 1);
+		}
+
+		/** Inserts several elements into the ring buffer, updating the shared index only once. The
+		 *  caller must have checked that there is room for all of them.
+		 *
+		 *  \param[in,out] Buffer  Pointer to a ring buffer structure to insert into
+		 *  \param[in]     Data    Data elements to insert into the buffer
+		 *  \param[in]     Count   Number of elements to insert
+		 */
+		static inline void RingBuffer_InsertBulk(RingBuff_t* const Buffer,
+		                                         const RingBuff_Data_t* Data,
+		                                         RingBuff_Count_t Count)
+		{
+			uint8_t In = Buffer->In;
+
+			while (Count--)
+			  Buffer->Buffer[In++ & (BUFFER_SIZE - 1)] = *(Data++);
+
+			RINGBUFF_BARRIER();
+			Buffer->In = In;
 		}
 
 		/** Removes an element from the ring buffer.
@@ -181,17 +189,30 @@
 		 */
 		static inline RingBuff_Data_t RingBuffer_Remove(RingBuff_t* const Buffer)
 		{
-			RingBuff_Data_t Data = *Buffer->Out;
-			
-			if (++Buffer->Out == &Buffer->Buffer[BUFFER_SIZE])
-			  Buffer->Out = Buffer->Buffer;
+			uint8_t         Out = Buffer->Out;
+			RingBuff_Data_t Data;
 
-			ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
-			{
-				Buffer->Count--;
-			}
+			RINGBUFF_BARRIER();
+			Data = Buffer->Buffer[Out & (BUFFER_SIZE - 1)];
+
+			RINGBUFF_BARRIER();
+			Buffer->Out = (Out + 1);
 			
 			return Data;
 		}
 
+		/** Returns the next element of the ring buffer without removing it. Must only be called
+		 *  by the consumer, on a buffer which is not empty.
+		 *
+		 *  \param[in] Buffer  Pointer to a ring buffer structure to look into
+		 *
+		 *  \return Next data element stored in the buffer
+		 */
+		static inline RingBuff_Data_t RingBuffer_Peek(RingBuff_t* const Buffer)
+		{
+			RINGBUFF_BARRIER();
+
+			return Buffer->Buffer[Buffer->Out & (BUFFER_SIZE - 1)];
+		}
+
 #endif
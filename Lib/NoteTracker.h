@@ -0,0 +1,147 @@
+/*
+ * USB-MIDI <-> Serial MIDI converter.
+ *
+ * This software is Copyright (c) 2011 by Florian Ragwitz.
+ *
+ * This is free software, licensed under:
+ *   The GNU General Public License, Version 2, June 1991
+ */
+
+/** \file
+ *
+ *  Compact tracker of the notes currently held on each MIDI channel, so that
+ *  exactly the needed note offs can be sent when the host goes away. Held notes
+ *  are kept in a short list rather than a bit per note, so the tracker fits the
+ *  RAM of an ATmega8U2; a channel with more notes held than the list has room
+ *  for is only marked, and released with an All Notes Off controller.
+ */
+
+#ifndef _NOTE_TRACKER_H_
+#define _NOTE_TRACKER_H_
+
+	/* Includes: */
+		#include <stdint.h>
+		#include <stdbool.h>
+
+	/* Defines: */
+		/** Number of notes the tracker holds, over all channels. */
+		#define NOTE_TRACKER_SLOTS  32
+
+	/* Type Defines: */
+		/** Type define for a note tracker. Trackers should be initialized via a call to
+		 *  \ref NoteTracker_Init() before use.
+		 */
+		typedef struct
+		{
+			uint8_t  Channel[NOTE_TRACKER_SLOTS]; /**< MIDI channel of each held note. */
+			uint8_t  Note[NOTE_TRACKER_SLOTS];    /**< Note number of each held note. */
+			uint8_t  Count;                       /**< Number of notes held. */
+			uint16_t Overflowed;                  /**< One bit per channel which had a note on the list had no room for. */
+		} NoteTracker_t;
+
+	/* Inline Functions: */
+		/** Initializes a note tracker, forgetting all held notes.
+		 *
+		 *  \param[out] Tracker  Pointer to a note tracker structure to initialize
+		 */
+		static inline void NoteTracker_Init(NoteTracker_t* const Tracker)
+		{
+			Tracker->Count      = 0;
+			Tracker->Overflowed = 0;
+		}
+
+		/** Finds a held note.
+		 *
+		 *  \param[in] Tracker  Pointer to a note tracker structure to search
+		 *  \param[in] Channel  MIDI channel of the note, 0 to 15
+		 *  \param[in] Note     Note number, 0 to 127
+		 *
+		 *  \return Index of the note in the tracker's list, or NOTE_TRACKER_SLOTS if it is not held
+		 */
+		static inline uint8_t NoteTracker_Find(NoteTracker_t* const Tracker,
+		                                       const uint8_t Channel,
+		                                       const uint8_t Note)
+		{
+			uint8_t i;
+
+			for (i = 0; i < Tracker->Count; i++)
+			{
+				if (Tracker->Note[i] == Note && Tracker->Channel[i] == Channel)
+				  return i;
+			}
+
+			return NOTE_TRACKER_SLOTS;
+		}
+
+		/** Records a note on. When the list is full, the note's channel is marked instead.
+		 *
+		 *  \param[in,out] Tracker  Pointer to a note tracker structure to update
+		 *  \param[in]     Channel  MIDI channel of the note, 0 to 15
+		 *  \param[in]     Note     Note number, 0 to 127
+		 */
+		static inline void NoteTracker_NoteOn(NoteTracker_t* const Tracker,
+		                                      const uint8_t Channel,
+		                                      const uint8_t Note)
+		{
+			if (NoteTracker_Find(Tracker, Channel, Note) != NOTE_TRACKER_SLOTS)
+			  return;
+
+			if (Tracker->Count == NOTE_TRACKER_SLOTS)
+			{
+				Tracker->Overflowed |= (1 << Channel);
+				return;
+			}
+
+			Tracker->Channel[Tracker->Count] = Channel;
+			Tracker->Note[Tracker->Count]    = Note;
+			Tracker->Count++;
+		}
+
+		/** Records a note off. The last note of the list takes the place of the released one.
+		 *
+		 *  \param[in,out] Tracker  Pointer to a note tracker structure to update
+		 *  \param[in]     Channel  MIDI channel of the note, 0 to 15
+		 *  \param[in]     Note     Note number, 0 to 127
+		 */
+		static inline void NoteTracker_NoteOff(NoteTracker_t* const Tracker,
+		                                       const uint8_t Channel,
+		                                       const uint8_t Note)
+		{
+			uint8_t i = NoteTracker_Find(Tracker, Channel, Note);
+
+			if (i == NOTE_TRACKER_SLOTS)
+			  return;
+
+			Tracker->Count--;
+			Tracker->Channel[i] = Tracker->Channel[Tracker->Count];
+			Tracker->Note[i]    = Tracker->Note[Tracker->Count];
+		}
+
+		/** Forgets all notes held on a channel, e.g. after an All Notes Off controller.
+		 *
+		 *  \param[in,out] Tracker  Pointer to a note tracker structure to update
+		 *  \param[in]     Channel  MIDI channel to clear, 0 to 15
+		 */
+		static inline void NoteTracker_ClearChannel(NoteTracker_t* const Tracker,
+		                                            const uint8_t Channel)
+		{
+			uint8_t i = 0;
+
+			while (i < Tracker->Count)
+			{
+				if (Tracker->Channel[i] == Channel)
+				{
+					Tracker->Count--;
+					Tracker->Channel[i] = Tracker->Channel[Tracker->Count];
+					Tracker->Note[i]    = Tracker->Note[Tracker->Count];
+				}
+				else
+				{
+					i++;
+				}
+			}
+
+			Tracker->Overflowed &= ~(1 << Channel);
+		}
+
+#endif
@@ -36,6 +36,27 @@
 
 #include <LUFA/Drivers/Peripheral/Serial.c>
 
+#include "Lib/LightweightRingBuff.h"
+
+#ifdef NOTE_TRACKER
+#include "Lib/NoteTracker.h"
+#endif
+
+#ifdef TRACE
+/* A 32 record trace takes 135 bytes, which leaves too little of the 512
+ * bytes of RAM of an ATmega8U2 or ATmega16U2 to LUFA and the stack. */
+#if defined(__AVR_ATmega8U2__) || defined(__AVR_ATmega16U2__)
+#define TRACE_SIZE 16
+#endif
+#include "Lib/EventTrace.h"
+#endif
+
+/* Scheduled output works on the MIDI byte stream, which link mode
+ * doesn't carry. */
+#ifdef LINK_MODE
+#undef SCHEDULER
+#endif
+
 typedef enum {
     STATE_UNKNOWN,
     STATE_1PARAM,
@@ -68,10 +89,580 @@ USB_ClassInfo_MIDI_Device_t Keyboard_MIDI_Interface =
             },
     };
 
+/* The runtime configuration lives in EEPROM. It is loaded once at boot and
+ * expanded into the flat lookup tables below, so the per-byte paths only
+ * ever do a table lookup, however many options are set. */
+#ifndef LINK_BAUD
+#define LINK_BAUD 500000
+#endif
+
+MIDI_Config_t EEMEM config_eeprom;
+MIDI_Config_t config;
+
+/* A configuration sent by the host, to be applied by the main loop. It
+ * stays pending, and no new one is taken, until it is also in EEPROM. */
+MIDI_Config_t config_new;
+volatile bool config_pending;
+uint8_t config_written;
+
+/* Number of MIDI bytes in an event packet, indexed by CIN. */
+static const uint8_t cin_size[16] PROGMEM = {
+    3, 3, 2, 3, 3, 1, 2, 3, 3, 3, 3, 3, 2, 2, 3, 1,
+};
+
+/* Whether packets from the serial side go to USB, indexed by CIN. */
+bool in_pass[16];
+
+/* How many bytes of a packet from USB go out via UART, indexed by CIN. A
+ * zero drops the packet. */
+uint8_t out_len[16];
+
+/* Whether packets from USB are forwarded, indexed by cable number. */
+bool cable_pass[16];
+
+/* Cable number of packets from the serial side, already shifted into
+ * place. */
+uint8_t serial_cable;
+
+void
+config_defaults (MIDI_Config_t *c)
+{
+    uint8_t i;
+
+    c->Version = MIDI_CONFIG_VERSION;
+    c->Cable = MIDI_CABLE;
+#ifdef MERGE_CABLES
+    c->CableMask = 0xffff;
+#else
+    c->CableMask = 1 << MIDI_CABLE;
+#endif
+    c->InFilter = 0xffff;
+    c->OutFilter = 0xffff;
+#ifdef LINK_MODE
+    c->Baud = LINK_BAUD;
+#else
+    c->Baud = 31250;
+#endif
+
+    c->TransformDirections = 0;
+    for (i = 0; i < 16; i++)
+        c->ChannelMap[i] = i;
+    c->Transpose = 0;
+    c->NoteLow = 0;
+    c->NoteHigh = 127;
+    c->VelocityCurve = VELOCITY_LINEAR;
+    c->VelocityValue = 100;
+}
+
+bool
+config_valid (const MIDI_Config_t *c)
+{
+    uint8_t i;
+
+    for (i = 0; i < 16; i++)
+        if (c->ChannelMap[i] > 15)
+            return false;
+
+    return c->Version == MIDI_CONFIG_VERSION && c->Cable < 16 && c->Baud
+        && c->NoteLow <= c->NoteHigh && c->NoteHigh < 128
+        && c->VelocityCurve <= VELOCITY_FIXED
+        && c->VelocityValue && c->VelocityValue < 128;
+}
+
+#ifdef TRANSFORMS
+/* The tables below take 304 bytes, which the 512 bytes of RAM of an
+ * ATmega8U2 or ATmega16U2 cannot spare next to the ring buffers and the
+ * stack. */
+#if defined(__AVR_ATmega8U2__) || defined(__AVR_ATmega16U2__)
+#error "TRANSFORMS needs the 1KB of RAM of an ATmega32U2 (MCU = atmega32u2)"
+#endif
+
+/* Transform stage. Channel remapping, transposing with clamping and the
+ * velocity curve are all precomputed into tables, so a message costs the
+ * same few lookups whatever the settings. */
+uint8_t channel_map[16];
+uint8_t note_map[128];
+uint8_t velocity_map[128];
+
+/* Whether to transform packets in either direction, indexed by CIN. */
+bool in_transform[16];
+bool out_transform[16];
+
+uint8_t
+velocity_curve (uint8_t v)
+{
+    uint16_t inv = 127 - v;
+    uint8_t r;
+
+    /* A velocity of 0 means note off, whatever the curve. */
+    if (!v)
+        return 0;
+
+    switch (config.VelocityCurve) {
+    case VELOCITY_SOFT:
+        r = 127 - (inv * inv) / 127;
+        break;
+    case VELOCITY_HARD:
+        r = ((uint16_t)v * v) / 127;
+        break;
+    case VELOCITY_FIXED:
+        r = config.VelocityValue;
+        break;
+    default:
+        r = v;
+        break;
+    }
+
+    /* Nor may any other velocity turn into a note off. */
+    return r ? r : 1;
+}
+
+void
+transform_apply (void)
+{
+    uint8_t i;
+
+    for (i = 0; i < 16; i++) {
+        bool channel = (i >= 0x8 && i <= 0xe);
+
+        channel_map[i] = config.ChannelMap[i];
+        in_transform[i] = channel && (config.TransformDirections & TRANSFORM_TO_USB);
+        out_transform[i] = channel && (config.TransformDirections & TRANSFORM_TO_SERIAL);
+    }
+
+    for (i = 0; i < 128; i++) {
+        int16_t note = i + config.Transpose;
+
+        if (note < config.NoteLow)
+            note = config.NoteLow;
+        else if (note > config.NoteHigh)
+            note = config.NoteHigh;
+
+        note_map[i] = note;
+        velocity_map[i] = velocity_curve(i);
+    }
+}
+
+/* Run a channel message through the transform tables. */
+void
+transform (uint8_t *status, uint8_t *d1, uint8_t *d2)
+{
+    uint8_t type = *status & 0xf0;
+
+    *status = type | channel_map[*status & 0x0f];
+
+    if (type <= 0xa0) { /* note off, note on, poly keypress */
+        *d1 = note_map[*d1 & 0x7f];
+        if (type != 0xa0)
+            *d2 = velocity_map[*d2 & 0x7f];
+    }
+}
+#endif
+
+/* Expand the configuration into the lookup tables. */
+void
+config_apply (void)
+{
+    uint8_t i;
+
+    for (i = 0; i < 16; i++) {
+        in_pass[i] = config.InFilter & (1 << i);
+        /* CINs 0x0 and 0x1 are reserved, and never forwarded. */
+        out_len[i] = (i > 0x1 && (config.OutFilter & (1 << i))) ? pgm_read_byte(&cin_size[i]) : 0;
+        cable_pass[i] = config.CableMask & (1 << i);
+    }
+
+    serial_cable = config.Cable << 4;
+
+#ifdef TRANSFORMS
+    transform_apply();
+#endif
+}
+
+void
+config_load (void)
+{
+    eeprom_read_block(&config, &config_eeprom, sizeof(config));
+    if (!config_valid(&config))
+        config_defaults(&config);
+
+    config_apply();
+}
+
+/* Take over a configuration sent by the host, and store it. The baud rate
+ * only changes on the next power up. An EEPROM write takes 3.4ms, so
+ * rather than wait for all of them, each call writes one byte, and only
+ * once the previous write has finished. */
+void
+config_save (void)
+{
+    if (!eeprom_is_ready())
+        return;
+
+    if (config_written == 0) {
+        uint32_t baud = config.Baud;
+
+        config = config_new;
+        config_apply();
+        config.Baud = baud;
+    }
+
+    eeprom_update_byte((uint8_t *)&config_eeprom + config_written,
+                       ((uint8_t *)&config_new)[config_written]);
+
+    if (++config_written == sizeof(config_new)) {
+        config_written = 0;
+        config_pending = false;
+    }
+}
+
+/* Read timer 1. Its count is read through the TEMP register, which the
+ * interrupts that read or set the timer share, so one of them between the
+ * two byte reads would tear the value. */
+uint16_t
+timer_read (void)
+{
+    uint16_t t;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        t = TCNT1;
+    }
+
+    return t;
+}
+
+#ifdef PROFILE
+/* Time spent in each stage of the main loop and in our interrupts, read
+ * out by the host with REQ_GetProfile. Stages are timed with the raw timer
+ * value, so a single run has to stay under 32ms. */
+MIDI_Profile_t profile;
+
+void
+profile_add (uint8_t stage, uint16_t ticks)
+{
+    MIDI_ProfileStage_t *s = &profile.Stages[stage];
+
+    s->Ticks += ticks;
+    s->Calls++;
+    if (ticks > s->Worst)
+        s->Worst = ticks;
+}
+
+#define profile_start(t) uint16_t t = timer_read()
+#define profile_end(stage, t) profile_add((stage), timer_read() - (t))
+#else
+#define profile_start(t)
+#define profile_end(stage, t)
+#endif
+
+#ifdef IDLE_SLEEP
+/* Idle sleep statistics, read out by the host with REQ_GetIdleStats. */
+MIDI_IdleStats_t idle;
+#endif
+
+/* Timer 1 is free-running at F_CPU/8. The overflow interrupt extends it to
+ * 32 bits, which gives 0.5us timestamps that wrap after about 35 minutes. */
+volatile uint16_t timer_overflows;
+
+ISR (TIMER1_OVF_vect)
+{
+    profile_start(t);
+    timer_overflows++;
+    profile_end(PROFILE_TIMER, t);
+}
+
+void
+timer_init (void)
+{
+    TCCR1A = 0;
+    TCCR1B = (1 << CS11);
+    TIMSK1 = (1 << TOIE1);
+}
+
+uint32_t
+timestamp (void)
+{
+    uint16_t hi, lo;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        hi = timer_overflows;
+        lo = TCNT1;
+        /* An overflow that happened after we got here hasn't been counted
+         * yet. */
+        if ((TIFR1 & (1 << TOV1)) && lo < 0x8000)
+            hi++;
+    }
+
+    return ((uint32_t)hi << 16) | lo;
+}
+
+#ifdef TRACE
+/* Event trace, armed and read out by the host with REQ_SetTrace and
+ * REQ_GetTrace. Records only take the raw timer value and the low bits of
+ * the overflow count, so recording stays a few cycles. Those are read with
+ * interrupts off, as reading TCNT1 goes through the TEMP register which the
+ * serial and scheduler interrupts use too. */
+Trace_t event_trace;
+
+#define trace(kind, value) do { \
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { \
+        Trace_Record(&event_trace, TCNT1, (kind) | ((uint8_t)timer_overflows << 4), (value)); \
+    } \
+} while (0)
+#else
+#define trace(kind, value)
+#endif
+
+/* When each startup phase was reached, read out by the host with
+ * REQ_GetBootTimes. */
+MIDI_BootTimes_t boot_times;
+
+/* Record the time of a phase the first time it is reached. A time of 0 is
+ * a valid timestamp, so whether a phase was reached is kept in a mask. */
+void
+boot_mark (uint8_t phase)
+{
+    if (boot_times.Reached & (1 << phase))
+        return;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (!(boot_times.Reached & (1 << phase))) {
+            boot_times.Times[phase] = timestamp();
+            boot_times.Reached |= (1 << phase);
+        }
+    }
+}
+
+/* Everything the bridge had to drop, read out by the host with
+ * REQ_GetLossCounters. */
+MIDI_LossCounters_t losses;
+
+/* Diagnostic loopback modes, selected by the host with REQ_SetDiagMode.
+ * They take one half of the bridge out of the picture so the other can be
+ * benchmarked on its own. */
+MIDI_DiagStats_t diag;
+uint32_t diag_window;
+uint32_t diag_window_packets;
+uint32_t diag_window_bytes;
+
+void
+diag_select (uint8_t mode)
+{
+    memset(&diag, 0, sizeof(diag));
+    diag.Mode = mode;
+    diag_window = timestamp();
+    diag_window_packets = 0;
+    diag_window_bytes = 0;
+}
+
+/* Latch the packet and byte rates once a second. */
+void
+diag_tick (void)
+{
+    uint32_t now = timestamp();
+
+    if (now - diag_window < 1000UL * TICKS_PER_MS)
+        return;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        diag.PacketRate = diag.Packets - diag_window_packets;
+        diag.ByteRate = diag.Bytes - diag_window_bytes;
+    }
+    diag_window_packets = diag.Packets;
+    diag_window_bytes = diag.Bytes;
+    diag_window = now;
+}
+
+/* Whether packets have been written to the IN endpoint since it was last
+ * flushed. The main loop flushes once per round rather than per packet, so
+ * a burst from the serial side leaves in full banks. */
+bool in_dirty;
+
+/* Universal MIDI Packet support for the MIDI 2.0 alternate setting of the
+ * streaming interface. In that mode the serial side is translated to and
+ * from UMP instead of USB-MIDI 1.0 event packets, using the MIDI 1.0
+ * protocol in the group of the configured cable.
+ *
+ * http://www.usb.org/developers/docs/devclass_docs/USB_MIDI_v2_0.pdf
+ */
+uint8_t ump_enabled;
+
+/* Size in 32-bit words of a UMP, indexed by its message type. */
+static const uint8_t ump_words[16] PROGMEM = {
+    1, 1, 1, 2, 2, 4, 1, 1, 2, 2, 2, 3, 3, 4, 4, 4,
+};
+
+enum {
+    UMP_SYSEX_COMPLETE,
+    UMP_SYSEX_START,
+    UMP_SYSEX_CONTINUE,
+    UMP_SYSEX_END,
+};
+
+/* Jitter reduction timestamps count in units of 32us, which is exactly 64
+ * timer ticks. */
+#define JR_TICKS_SHIFT 6
+
+/* Send a JR Clock at least this often, so the host can track our clock. */
+#define JR_CLOCK_INTERVAL (250UL * TICKS_PER_MS)
+
+uint32_t jr_clock_sent;
+
+uint8_t ump_sysex[6];
+uint8_t ump_sysex_len;
+uint8_t ump_sysex_group;
+bool ump_sysex_started;
+
+/* Write n UMP words to the IN endpoint. A UMP is never split across two
+ * USB packets. */
+void
+ump_send_words (const uint32_t *words, uint8_t n)
+{
+    if (USB_DeviceState != DEVICE_STATE_Configured)
+        return;
+
+    Endpoint_SelectEndpoint(MIDI_STREAM_IN_EPNUM);
+    if (Endpoint_BytesInEndpoint() + n * sizeof(uint32_t) > MIDI_STREAM_EPSIZE)
+        Endpoint_ClearIN();
+
+    if (Endpoint_WaitUntilReady() != ENDPOINT_READYWAIT_NoError) {
+        losses.USBPackets++;
+        return;
+    }
+
+    while (n--)
+        Endpoint_Write_DWord_LE(*words++);
+
+    if (!Endpoint_IsReadWriteAllowed())
+        Endpoint_ClearIN();
+}
+
+/* Arrival time of the serial byte being parsed, to 64us, which is the time
+ * a message from the serial port has arrived once its last byte is in. */
+uint32_t serial_time;
+
+/* Send a single 32-bit UMP, preceded by a JR Timestamp with the time it
+ * arrived on the serial port. The JR Clock goes out with the time it is
+ * sent, as the host expects. */
+void
+ump_send_stamped (uint32_t word)
+{
+    uint32_t now = timestamp();
+    uint32_t words[3];
+    uint8_t n = 0;
+
+    if (now - jr_clock_sent >= JR_CLOCK_INTERVAL) {
+        jr_clock_sent = now;
+        words[n++] = 0x00100000 | (uint16_t)(now >> JR_TICKS_SHIFT);
+    }
+
+    words[n++] = 0x00200000 | (uint16_t)(serial_time >> JR_TICKS_SHIFT);
+    words[n++] = word;
+
+    ump_send_words(words, n);
+}
+
+/* Emit the buffered SysEx bytes as one 64-bit SysEx7 UMP. */
+void
+ump_sysex_flush (uint8_t status)
+{
+    uint8_t *d = ump_sysex;
+    uint32_t words[2];
+
+    memset(d + ump_sysex_len, 0, sizeof(ump_sysex) - ump_sysex_len);
+
+    words[0] = 0x30000000 | ((uint32_t)ump_sysex_group << 24)
+             | ((uint32_t)status << 20) | ((uint32_t)ump_sysex_len << 16)
+             | ((uint16_t)d[0] << 8) | d[1];
+    words[1] = ((uint32_t)d[2] << 24) | ((uint32_t)d[3] << 16)
+             | ((uint16_t)d[4] << 8) | d[5];
+
+    ump_send_words(words, 2);
+    ump_sysex_len = 0;
+}
+
+/* Feed one byte of a SysEx message into the SysEx7 packer. Full packets are
+ * only sent once the next byte shows whether they continue or end the
+ * message. */
+void
+ump_sysex_byte (uint8_t group, uint8_t b)
+{
+    if (b == 0xf0) {
+        ump_sysex_group = group;
+        ump_sysex_len = 0;
+        ump_sysex_started = false;
+    } else if (b == 0xf7) {
+        ump_sysex_flush(ump_sysex_started ? UMP_SYSEX_END : UMP_SYSEX_COMPLETE);
+    } else {
+        if (ump_sysex_len == sizeof(ump_sysex)) {
+            ump_sysex_flush(ump_sysex_started ? UMP_SYSEX_CONTINUE : UMP_SYSEX_START);
+            ump_sysex_started = true;
+        }
+        ump_sysex[ump_sysex_len++] = b;
+    }
+}
+
+/* Translate a USB-MIDI 1.0 event packet into UMP and send it to the host. */
+void
+ump_send (uint8_t p0, uint8_t p1, uint8_t p2, uint8_t p3)
+{
+    uint8_t group = p0 >> 4;
+    uint32_t word = ((uint32_t)group << 24) | ((uint32_t)p1 << 16)
+                  | ((uint16_t)p2 << 8) | p3;
+
+    switch (p0 & 0x0f) {
+    case 0x4: /* sysex starts or continues */
+    case 0x7: /* sysex ends with following three bytes */
+        ump_sysex_byte(group, p1);
+        ump_sysex_byte(group, p2);
+        ump_sysex_byte(group, p3);
+        break;
+    case 0x6: /* sysex ends with following two bytes */
+        ump_sysex_byte(group, p1);
+        ump_sysex_byte(group, p2);
+        break;
+    case 0x5: /* single byte system common or sysex end */
+        if (p1 == 0xf7) {
+            ump_sysex_byte(group, p1);
+            break;
+        }
+        /* fall through */
+    case 0x2: /* 2 byte system common message */
+    case 0x3: /* 3 byte system common message */
+    case 0xf: /* single byte */
+        ump_send_stamped(0x10000000 | word);
+        break;
+    default: /* channel voice messages */
+        ump_send_stamped(0x20000000 | word);
+        break;
+    }
+
+    in_dirty = true;
+}
+
 /* Send n MIDI bytes in buf over USB */
 void
 midi_send (uint8_t p0, uint8_t p1, uint8_t p2, uint8_t p3)
 {
+    if (!in_pass[p0 & 0x0f])
+        return;
+
+    trace(TRACE_SENT_PACKET, p0);
+
+#ifdef TRANSFORMS
+    if (in_transform[p0 & 0x0f])
+        transform(&p1, &p2, &p3);
+#endif
+
+    if (diag.Mode == DIAG_UART_LOOP)
+        diag.Packets++;
+
+    if (ump_enabled) {
+        ump_send(p0, p1, p2, p3);
+        boot_mark(BOOT_FIRST_MIDI);
+        return;
+    }
+
     MIDI_EventPacket_t MIDIEvent = {
         .CableNumber = (p0 >> 4),
         .Command     = (p0 & 0x0f),
@@ -80,8 +671,10 @@ midi_send (uint8_t p0, uint8_t p1, uint8_t p2, uint8_t p3)
         .Data3       = p3,
     };
 
-    MIDI_Device_SendEventPacket(&Keyboard_MIDI_Interface, &MIDIEvent);
-    MIDI_Device_Flush(&Keyboard_MIDI_Interface);
+    if (MIDI_Device_SendEventPacket(&Keyboard_MIDI_Interface, &MIDIEvent))
+        losses.USBPackets++;
+    in_dirty = true;
+    boot_mark(BOOT_FIRST_MIDI);
 }
 
 uint8_t data[2];
@@ -128,7 +721,14 @@ midi_state state = STATE_UNKNOWN;
 void
 usb_write (uint8_t b)
 {
-    uint8_t p0 = MIDI_CABLE;
+    uint8_t p0 = serial_cable;
+#ifdef TRACE
+    midi_state old_state = state;
+
+    trace(TRACE_SERIAL_BYTE, b);
+    if (b >= 0x80 && b < 0xf7 && state >= STATE_SYSEX_0)
+        trace(TRACE_SYSEX_ABORT, b);
+#endif
 
     if (b >= 0xf8) {
         midi_send(p0 | 0x0f, b, 0, 0);
@@ -219,89 +819,1585 @@ usb_write (uint8_t b)
             break;
         }
     }
+
+#ifdef TRACE
+    if (state != old_state)
+        trace(TRACE_PARSER_STATE, (old_state << 4) | state);
+#endif
 }
 
-/* Read MIDI packets from USB and send them out again via UART. */
-void
-usb_read (MIDI_EventPacket_t *ReceivedMIDIEvent)
+#ifdef LINK_MODE
+/* Link mode carries whole USB-MIDI event packets, cable number included,
+ * between the USB chip and the main MCU instead of a MIDI byte stream.
+ *
+ * Each packet is sent as a frame of a header byte, the cable/CIN byte and
+ * as many data bytes as the CIN says the packet has. Only the header has
+ * bit 7 set, so a receiver that lost track simply waits for the next one:
+ *
+ *   1 c c c m m m m   header: c = checksum, m = bit 7 of p0, p1, p2, p3
+ *   0 x x x x x x x   p0: cable number (low 3 bits) and CIN
+ *   0 x x x x x x x   p1..p3, 0 to 3 of them
+ */
+uint8_t link_frame[4];
+uint8_t link_header;
+uint8_t link_len;
+
+uint8_t
+link_checksum (const uint8_t *p)
 {
-    if (ReceivedMIDIEvent->CableNumber != MIDI_CABLE)
-        return;
+    uint8_t c = (p[0] ^ p[1] ^ p[2] ^ p[3]) & 0x7f;
 
-    /* http://www.usb.org/developers/devclass_docs/midi10.pdf p.16f */
-    switch (ReceivedMIDIEvent->Command) {
-    case 0x0: /* misc - reserved for future use */
-    case 0x1: /* cable events - reserved for future use */
-        break;
-    case 0x5: /* single byte system common message or sysex ends with
-               * following single byte */
-    case 0xf: /* single byte for transfer w/o parsing or RT messages */
-        Serial_TxByte(ReceivedMIDIEvent->Data1);
-        break;
-    case 0x2: /* 2 byte system common message */
-    case 0x6: /* sysex ends with following two bytes */
-    case 0xc: /* program change */
-    case 0xd: /* channel pressure */
-        Serial_TxByte(ReceivedMIDIEvent->Data1);
-        Serial_TxByte(ReceivedMIDIEvent->Data2);
-        break;
-    case 0x3: /* 3 byte system common message */
-    case 0x4: /* sysex starts or continues */
-    case 0x7: /* sysex ends with following three bytes */
-    case 0x8: /* note off */
-    case 0x9: /* note on */
-    case 0xa: /* poly keypress */
-    case 0xb: /* control change */
-    case 0xe: /* pitchbend change */
-        Serial_TxByte(ReceivedMIDIEvent->Data1);
-        Serial_TxByte(ReceivedMIDIEvent->Data2);
-        Serial_TxByte(ReceivedMIDIEvent->Data3);
-        break;
-    }
+    return (c ^ (c >> 3) ^ (c >> 6)) & 0x07;
 }
 
-/** Main program entry point. This routine contains the overall program flow, including initial
- *  setup of all components and the main program loop.
- */
-int main(void)
+/* Collect a frame from the main MCU and pass the event packet in it on to
+ * USB once it is complete. */
+void
+link_receive (uint8_t b)
 {
-    SetupHardware();
+    uint8_t i;
 
-    LEDs_SetAllLEDs(LEDMASK_USB_NOTREADY);
-    sei();
+    if (b & 0x80) {
+        if (link_len)
+            losses.LinkFrames++;
+        link_header = b;
+        link_len = 1;
+        memset(link_frame, 0, sizeof(link_frame));
+        return;
+    }
 
-    for (;;) {
-        while (Serial_IsCharReceived())
-            usb_write(Serial_RxByte());
+    if (!link_len)
+        return;
+
+    link_frame[link_len - 1] = b;
+    if (link_len++ <= pgm_read_byte(&cin_size[link_frame[0] & 0x0f]))
+        return;
+    link_len = 0;
 
-        MIDI_EventPacket_t ReceivedMIDIEvent;
-        while (MIDI_Device_ReceiveEventPacket(&Keyboard_MIDI_Interface, &ReceivedMIDIEvent))
-            usb_read(&ReceivedMIDIEvent);
+    for (i = 0; i < 4; i++)
+        if (link_header & (0x08 >> i))
+            link_frame[i] |= 0x80;
 
-        MIDI_Device_USBTask(&Keyboard_MIDI_Interface);
-        USB_USBTask();
+    if (link_checksum(link_frame) != ((link_header >> 4) & 0x07)) {
+        losses.LinkFrames++;
+        return;
     }
+
+    midi_send(link_frame[0], link_frame[1], link_frame[2], link_frame[3]);
 }
+#endif
 
-/** Configures the board hardware and chip peripherals for the demo's functionality. */
-void SetupHardware(void)
-{
-    /* Disable watchdog if enabled by bootloader/fuses */
-    MCUSR &= ~(1 << WDRF);
-    wdt_disable();
+#ifdef NOTE_TRACKER
+/* Notes we've sent out via UART and not released yet. */
+NoteTracker_t held_notes;
+volatile bool notes_off_pending;
 
-    /* Disable clock division */
-    //clock_prescale_set(clock_div_1);
+/* Keep track of the notes held downstream from a channel message that is
+ * about to go out via UART. Scheduled messages are tracked from the timer
+ * interrupt as they are released, so the main loop's updates have to be
+ * atomic. */
+void
+track_note (uint8_t status, uint8_t note, uint8_t value)
+{
+    uint8_t channel = status & 0x0f;
 
-    /* Hardware Initialization */
-    LEDs_Init();
-    Serial_Init(31250, false);
-    USB_Init();
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        switch (status & 0xf0) {
+        case 0x90:
+            if (value) {
+                NoteTracker_NoteOn(&held_notes, channel, note);
+                break;
+            }
+            /* fall through */
+        case 0x80:
+            NoteTracker_NoteOff(&held_notes, channel, note);
+            break;
+        case 0xb0:
+            if (note == 120 || note == 123) /* all sound off, all notes off */
+                NoteTracker_ClearChannel(&held_notes, channel);
+            break;
+        }
+    }
+}
+#endif
+
+#ifdef SCHEDULER
+/* Messages the host has scheduled for a given time, see SYSEX_SCHEDULE.
+ * The queue is kept in time order and released into sched_tx by the
+ * timer 1 compare B interrupt. The UDRE interrupt slots them in between
+ * the messages of the main stream. */
+#define SCHED_SLOTS 8
+
+typedef struct {
+    uint32_t time;
+    uint8_t len;
+    uint8_t data[3];
+} sched_t;
+
+sched_t sched[SCHED_SLOTS];
+uint8_t sched_count;
+RingBuff_t sched_tx;
+
+/* Number of data bytes following a status byte. */
+uint8_t
+midi_data_len (uint8_t status)
+{
+    switch (status & 0xf0) {
+    case 0xc0:
+    case 0xd0:
+        return 1;
+    case 0xf0:
+        if (status == 0xf1 || status == 0xf3)
+            return 1;
+        if (status == 0xf2)
+            return 2;
+        return 0;
+    default:
+        return 2;
+    }
+}
+
+/* Move every message that is due into sched_tx, and set up the compare
+ * for the next one. Called with interrupts off. */
+void
+sched_release (void)
+{
+    for (;;) {
+        uint32_t now = timestamp();
+
+        while (sched_count && (int32_t)(sched[0].time - now) <= 0) {
+            if (BUFFER_SIZE - RingBuffer_GetCount(&sched_tx) < sched[0].len) {
+                /* Try again once a byte has gone out. */
+                OCR1B = TCNT1 + 640;
+                return;
+            }
+
+#ifdef NOTE_TRACKER
+            track_note(sched[0].data[0], sched[0].data[1], sched[0].data[2]);
+#endif
+            RingBuffer_InsertBulk(&sched_tx, sched[0].data, sched[0].len);
+            UCSR1B |= (1 << UDRIE1);
+
+            sched_count--;
+            memmove(sched, sched + 1, sched_count * sizeof(sched_t));
+        }
+
+        if (!sched_count) {
+            TIMSK1 &= ~(1 << OCIE1B);
+            return;
+        }
+
+        /* A deadline the timer passes while we are at it would only match
+         * once the timer comes round again, 32ms late, so look again. */
+        OCR1B = (uint16_t)sched[0].time;
+        if ((int32_t)(sched[0].time - timestamp()) > 0)
+            return;
+    }
+}
+
+/* The compare matches every time the low half of the timer passes the
+ * next deadline, so one far away comes back here every 32ms until it is
+ * due. */
+ISR (TIMER1_COMPB_vect)
+{
+    profile_start(t);
+    sched_release();
+    profile_end(PROFILE_TIMER, t);
+}
+
+/* Queue a message for the given 21-bit time in JR units. */
+void
+sched_add (uint32_t when, const uint8_t *data, uint8_t len)
+{
+    uint32_t now, time;
+    uint8_t i;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (sched_count == SCHED_SLOTS) {
+            losses.ScheduledMessages++;
+            return;
+        }
+
+        now = timestamp();
+        when = (when - (now >> JR_TICKS_SHIFT)) & 0x1fffff;
+        /* The upper half of the range is in the past. */
+        if (when & 0x100000)
+            when = 0;
+        time = now + (when << JR_TICKS_SHIFT);
+
+        for (i = sched_count; i && (int32_t)(sched[i - 1].time - time) > 0; i--)
+            sched[i] = sched[i - 1];
+        sched[i].time = time;
+        sched[i].len = len;
+        memcpy(sched[i].data, data, len);
+        sched_count++;
+
+        if (i == 0) {
+            OCR1B = (uint16_t)time;
+            TIFR1 = (1 << OCF1B);
+            TIMSK1 |= (1 << OCIE1B);
+        }
+
+        /* A deadline the timer has already passed won't match until it
+         * wraps around. */
+        sched_release();
+    }
+}
+
+/* Track of the main stream for the UDRE interrupt: the data bytes still
+ * due for its current message, its running status, and whether that has
+ * to be sent again because a scheduled message went out in between. */
+uint8_t tx_left;
+uint8_t tx_status;
+bool tx_sysex;
+bool tx_restore;
+uint8_t sched_left;
+#endif
+
+/* Bytes between the USART interrupts and the main loop. */
+RingBuff_t serial_rx;
+RingBuff_t serial_tx;
+
+#ifndef LINK_MODE
+/* Arrival time of each byte in serial_rx, as bits 7 to 14 of the timer, so
+ * in units of 64us. That is as cheap as it gets in the interrupt, and
+ * covers 16ms, longer than a full ring takes to arrive at 31250 baud. */
+uint8_t serial_rx_time[BUFFER_SIZE];
+#endif
+
+ISR (USART1_RX_vect, ISR_BLOCK)
+{
+    profile_start(t);
+    uint8_t status = UCSR1A;
+    uint8_t b = UDR1;
+
+    if (status & (1 << DOR1))
+        losses.SerialOverruns++;
+    if (status & (1 << FE1))
+        losses.SerialFrameErrors++;
+
+    if (RingBuffer_IsFull(&serial_rx)) {
+        losses.SerialOverruns++;
+    } else {
+#ifndef LINK_MODE
+        serial_rx_time[serial_rx.In & (BUFFER_SIZE - 1)] = TCNT1 >> 7;
+#endif
+        RingBuffer_Insert(&serial_rx, b);
+    }
+
+    profile_end(PROFILE_USART_RX, t);
+}
+
+#ifdef SCHEDULER
+/* Send the next byte, from the UDRE interrupt. */
+static inline void
+uart_next (void)
+{
+    uint8_t b;
+
+    /* A scheduled message only goes out between two messages of the main
+     * stream, and once started, it is sent in one piece. */
+    if (sched_left || (!RingBuffer_IsEmpty(&sched_tx) && !tx_left && !tx_sysex)) {
+        b = RingBuffer_Remove(&sched_tx);
+        if (!sched_left) {
+            sched_left = midi_data_len(b) + 1;
+            if (b < 0xf8)
+                tx_restore = (tx_status != 0);
+        }
+        sched_left--;
+        UDR1 = b;
+        return;
+    }
+
+    if (RingBuffer_IsEmpty(&serial_tx)) {
+        UCSR1B &= ~(1 << UDRIE1);
+        return;
+    }
+
+    b = RingBuffer_Peek(&serial_tx);
+
+    if (b < 0x80 && tx_restore) {
+        tx_restore = false;
+        UDR1 = tx_status;
+        return;
+    }
+
+    RingBuffer_Remove(&serial_tx);
+    UDR1 = b;
+
+    if (b >= 0xf8) {
+        /* real time, leaves the stream as it is */
+    } else if (b >= 0x80) {
+        tx_restore = false;
+        tx_sysex = (b == 0xf0);
+        tx_status = (b < 0xf0) ? b : 0;
+        tx_left = midi_data_len(b);
+    } else if (tx_left) {
+        tx_left--;
+    } else if (tx_status) {
+        tx_left = midi_data_len(tx_status) - 1;
+    }
+}
+#else
+/* Send the next byte, from the UDRE interrupt. */
+static inline void
+uart_next (void)
+{
+    UDR1 = RingBuffer_Remove(&serial_tx);
+
+    if (RingBuffer_IsEmpty(&serial_tx))
+        UCSR1B &= ~(1 << UDRIE1);
+}
+#endif
+
+ISR (USART1_UDRE_vect, ISR_BLOCK)
+{
+    profile_start(t);
+    uart_next();
+    profile_end(PROFILE_USART_UDRE, t);
+}
+
+/* Send a byte out via UART, or straight back into the serial parser when
+ * looping the UART side. */
+void
+uart_tx (uint8_t b)
+{
+    if (diag.Mode == DIAG_UART_LOOP) {
+        diag.Bytes++;
+#ifdef LINK_MODE
+        link_receive(b);
+#else
+        serial_time = timestamp();
+        usb_write(b);
+#endif
+        return;
+    }
+
+    while (RingBuffer_IsFull(&serial_tx))
+        ;
+
+    RingBuffer_Insert(&serial_tx, b);
+    UCSR1B |= (1 << UDRIE1);
+}
+
+#ifdef LINK_MODE
+/* Send an event packet to the main MCU. */
+void
+link_send (const MIDI_EventPacket_t *event)
+{
+    uint8_t p[4] = { 0 };
+    uint8_t n = pgm_read_byte(&cin_size[event->Command]);
+    uint8_t i;
+
+    /* Data bytes past the ones the CIN calls for aren't sent, so they must
+     * not count towards the checksum either. */
+    memcpy(p, event, n + 1);
+
+    uart_tx(0x80 | (link_checksum(p) << 4)
+                  | ((p[0] & 0x80) >> 4) | ((p[1] & 0x80) >> 5)
+                  | ((p[2] & 0x80) >> 6) | ((p[3] & 0x80) >> 7));
+
+    for (i = 0; i <= n; i++)
+        uart_tx(p[i] & 0x7f);
+}
+#endif
+
+/* Send the MIDI bytes in an event packet out via UART. */
+void
+serial_send (MIDI_EventPacket_t *ReceivedMIDIEvent)
+{
+#ifdef TRANSFORMS
+    if (out_transform[ReceivedMIDIEvent->Command])
+        transform(&ReceivedMIDIEvent->Data1, &ReceivedMIDIEvent->Data2, &ReceivedMIDIEvent->Data3);
+#endif
+
+#ifdef NOTE_TRACKER
+    if (ReceivedMIDIEvent->Command >= 0x8 && ReceivedMIDIEvent->Command <= 0xb)
+        track_note(ReceivedMIDIEvent->Data1, ReceivedMIDIEvent->Data2, ReceivedMIDIEvent->Data3);
+#endif
+
+    /* http://www.usb.org/developers/devclass_docs/midi10.pdf p.16f
+     * out_len has the number of bytes each CIN carries, or 0 for reserved
+     * and filtered ones. */
+    uint8_t n = out_len[ReceivedMIDIEvent->Command];
+
+    if (n)
+        uart_tx(ReceivedMIDIEvent->Data1);
+    if (n > 1)
+        uart_tx(ReceivedMIDIEvent->Data2);
+    if (n > 2)
+        uart_tx(ReceivedMIDIEvent->Data3);
+}
+
+#ifdef MERGE_CABLES
+/* Merge mode forwards the packets of all 16 cables to the UART. While one
+ * cable has a SysEx open, non real time packets of the other cables are
+ * held back, and sent in order once it has ended. A cable with packets
+ * held has all its later ones held too, so each cable stays in order. */
+#define MERGE_HOLD_SLOTS 16
+#define MERGE_NO_OWNER 0xff
+
+MIDI_EventPacket_t merge_held[MERGE_HOLD_SLOTS];
+uint8_t merge_held_count;
+uint16_t merge_held_cables;
+uint8_t sysex_owner = MERGE_NO_OWNER;
+
+/* Set when the host configures the device, from the control request
+ * interrupt, which can preempt the main loop in the middle of a drain. The
+ * reset itself is left to the main loop. */
+volatile bool merge_reset_pending;
+
+/* Cables whose current message lost a packet to a full hold queue. The
+ * rest of that message is dropped as well, up to its end, so that the
+ * wire never sees a SysEx with a hole spliced into it. */
+uint16_t merge_dropping;
+
+/* Set when a SysEx has ended with packets held behind it. These are then
+ * released by serve_out(), one per turn, ahead of new packets. */
+bool merge_draining;
+
+/* Running status of each cable, and of the wire, so that single bytes
+ * sent without parsing (CIN 0xf) still land on the right status after
+ * another cable has been merged in between. */
+uint8_t cable_status[16];
+uint8_t wire_status;
+
+bool
+merge_is_realtime (const MIDI_EventPacket_t *event)
+{
+    return event->Command == 0xf && event->Data1 >= 0xf8;
+}
+
+/* Whether a packet leaves its cable in the middle of a message: SysEx
+ * that has not ended, or a single byte other than an end of SysEx. */
+bool
+merge_opens (const MIDI_EventPacket_t *event)
+{
+    return event->Command == 0x4
+        || (event->Command == 0xf && event->Data1 < 0xf7);
+}
+
+/* Whether a packet begins a new message, abandoning an unfinished one. */
+bool
+merge_starts (const MIDI_EventPacket_t *event)
+{
+    switch (event->Command) {
+    case 0x2: case 0x3:
+    case 0x8: case 0x9: case 0xa: case 0xb: case 0xc: case 0xd: case 0xe:
+        return true;
+    case 0xf:
+        return event->Data1 >= 0x80 && event->Data1 < 0xf7;
+    default:
+        return false;
+    }
+}
+
+bool
+merge_may_send (const MIDI_EventPacket_t *event)
+{
+    return sysex_owner == MERGE_NO_OWNER || sysex_owner == event->CableNumber
+        || merge_is_realtime(event);
+}
+
+void
+merge_send (MIDI_EventPacket_t *event)
+{
+    uint8_t cable = event->CableNumber;
+    uint8_t b = event->Data1;
+
+    switch (event->Command) {
+    case 0x4: /* sysex starts or continues */
+        sysex_owner = cable;
+        cable_status[cable] = wire_status = 0;
+        break;
+    case 0xf: /* single byte */
+        if (b < 0x80) {
+            if (cable_status[cable] && cable_status[cable] != wire_status) {
+                uart_tx(cable_status[cable]);
+                wire_status = cable_status[cable];
+            }
+        } else if (b < 0xf0) {
+            cable_status[cable] = wire_status = b;
+            sysex_owner = MERGE_NO_OWNER;
+        } else if (b < 0xf8) {
+            cable_status[cable] = wire_status = 0;
+            sysex_owner = (b == 0xf0) ? cable : MERGE_NO_OWNER;
+        }
+        break;
+    case 0x8: case 0x9: case 0xa: case 0xb: /* channel messages */
+    case 0xc: case 0xd: case 0xe:
+        cable_status[cable] = wire_status = b;
+        sysex_owner = MERGE_NO_OWNER;
+        break;
+    default: /* system common, sysex end */
+        cable_status[cable] = wire_status = 0;
+        sysex_owner = MERGE_NO_OWNER;
+        break;
+    }
+
+    serial_send(event);
+}
+
+/* Send the first held packet that may go now. Ending a SysEx can release
+ * packets queued in front of it, so the queue is looked at from the start
+ * each time. Returns false, and stops the drain, when none may go. */
+bool
+merge_drain (void)
+{
+    uint16_t skipped = 0;
+    uint8_t i;
+
+    for (i = 0; i < merge_held_count; i++) {
+        MIDI_EventPacket_t *event = &merge_held[i];
+        uint16_t bit = 1 << event->CableNumber;
+
+        if ((skipped & bit) || !merge_may_send(event)) {
+            skipped |= bit;
+            continue;
+        }
+
+        merge_send(event);
+        merge_held_count--;
+        memmove(event, event + 1, (merge_held_count - i) * sizeof(*event));
+
+        for (merge_held_cables = skipped; i < merge_held_count; i++)
+            merge_held_cables |= 1 << merge_held[i].CableNumber;
+        return true;
+    }
+
+    merge_held_cables = skipped;
+    merge_draining = false;
+    return false;
+}
+
+void
+merge_reset (void)
+{
+    merge_held_count = 0;
+    merge_held_cables = 0;
+    merge_dropping = 0;
+    merge_draining = false;
+    sysex_owner = MERGE_NO_OWNER;
+    wire_status = 0;
+    memset(cable_status, 0, sizeof(cable_status));
+}
+
+void
+merge_packet (MIDI_EventPacket_t *event)
+{
+    uint16_t bit = 1 << event->CableNumber;
+
+    /* Nothing held from before the host configured us goes out after. */
+    if (merge_reset_pending) {
+        merge_reset_pending = false;
+        merge_reset();
+    }
+
+    if ((merge_dropping & bit) && !merge_is_realtime(event)) {
+        if (!merge_starts(event)) {
+            losses.MergePackets++;
+            if (!merge_opens(event))
+                merge_dropping &= ~bit;
+            return;
+        }
+        merge_dropping &= ~bit;
+    }
+
+    if (merge_is_realtime(event)
+        || (!(merge_held_cables & bit) && merge_may_send(event))) {
+        uint8_t owner = sysex_owner;
+
+        merge_send(event);
+        if (owner != MERGE_NO_OWNER && sysex_owner == MERGE_NO_OWNER && merge_held_count)
+            merge_draining = true;
+        return;
+    }
+
+    if (merge_held_count == MERGE_HOLD_SLOTS) {
+        losses.MergePackets++;
+        if (merge_opens(event))
+            merge_dropping |= bit;
+        return;
+    }
+
+    merge_held[merge_held_count++] = *event;
+    merge_held_cables |= bit;
+}
+#endif
+
+#ifndef LINK_MODE
+/* Send a packet from the host on to the serial side. */
+void
+usb_route (MIDI_EventPacket_t *event)
+{
+    if (!cable_pass[event->CableNumber])
+        return;
+#ifdef MERGE_CABLES
+    merge_packet(event);
+#else
+    serial_send(event);
+#endif
+}
+
+/* SysEx addressed to the bridge itself: Universal Device Inquiry, and the
+ * messages under SYSEX_ID_BRIDGE. These are answered here and never go out
+ * via UART. Whether a SysEx is ours is mostly decided on its first packet,
+ * which holds the ID and the sub-ID; an all-call Universal SysEx is held
+ * back until its second packet shows whether it is an inquiry. The rest of
+ * a message of ours is collected here rather than sent on. */
+#define OWN_NONE 0xff
+#define OWN_INQUIRY 0x7e
+
+uint8_t own_cable = OWN_NONE;
+uint8_t own_kind;
+MIDI_EventPacket_t own_held;
+uint8_t own_buf[6];
+uint8_t own_len;
+
+/* Identity Reply. The family is the USB product ID, the model the board's
+ * ARDUINO_MODEL_PID, and the version the USB release number. */
+static const uint8_t identity[] PROGMEM = {
+    0xf0, 0x7e, 0x7f, 0x06, 0x02, SYSEX_ID_BRIDGE,
+    MIDI_PRODUCT_ID & 0x7f, (MIDI_PRODUCT_ID >> 7) & 0x7f,
+    ARDUINO_MODEL_PID & 0x7f, (ARDUINO_MODEL_PID >> 7) & 0x7f,
+    MIDI_RELEASE_MAJOR, MIDI_RELEASE_MINOR, 0x00, 0x00,
+    0xf7,
+};
+
+/* Replies waiting to go out, one bit per kind, and the cable to send each
+ * on. A reply goes to the host as a SysEx of its own, so it has to wait
+ * while a SysEx from the serial port is on its way there: the two would
+ * interleave on one cable, and share the UMP SysEx packer. */
+#define REPLY_IDENTITY 0
+#define REPLY_CONFIG   1
+
+uint8_t reply_pending;
+uint8_t reply_cable[2];
+
+/* How long a reply waits on a SysEx from the serial port that has stopped
+ * coming in, as when the device sending it was unplugged half way. */
+#define REPLY_HOLD_TICKS (100UL * TICKS_PER_MS)
+
+/* Reply being packed into event packets for the host, and the cable the
+ * request for it came in on. */
+uint8_t reply[3];
+uint8_t reply_len;
+uint8_t reply_to;
+
+/* Add a byte to the reply. */
+void
+reply_byte (uint8_t b)
+{
+    uint8_t p0 = reply_to << 4;
+
+    reply[reply_len++] = b;
+
+    if (b == 0xf7)
+        p0 |= 0x4 + reply_len;
+    else if (reply_len == 3)
+        p0 |= 0x4;
+    else
+        return;
+
+    while (reply_len < 3)
+        reply[reply_len++] = 0;
+    reply_len = 0;
+    midi_send(p0, reply[0], reply[1], reply[2]);
+}
+
+/* Take a data byte of a message of ours. */
+void
+own_byte (uint8_t b)
+{
+    uint8_t *c = (uint8_t *)&config_new;
+    uint8_t i;
+
+    /* An overlong message is let through the length checks. */
+    if (own_len < 0xff)
+        own_len++;
+    i = own_len - 1;
+
+    switch (own_kind) {
+    case SYSEX_SET_CONFIG:
+        /* Two nibbles per byte, high one first. */
+        if (config_pending || i >= 2 * sizeof(config_new))
+            break;
+        if (i & 1)
+            c[i >> 1] |= b & 0x0f;
+        else
+            c[i >> 1] = b << 4;
+        break;
+    default:
+        if (i < sizeof(own_buf))
+            own_buf[i] = b;
+        break;
+    }
+}
+
+/* Act on a complete message of ours, F0, the IDs and F7 excluded. */
+void
+own_end (void)
+{
+    switch (own_kind) {
+#ifdef SCHEDULER
+    case SYSEX_SCHEDULE: {
+        /* t0 t1 t2, then the message with bit 7 of its status cleared. A
+         * SysEx, or an undefined status, can't be scheduled. */
+        uint8_t status = own_buf[3] | 0x80;
+
+        if (own_len < 4 || own_len > sizeof(own_buf)
+            || status == 0xf0 || status == 0xf4 || status == 0xf5 || status == 0xf7
+            || own_len != 4 + midi_data_len(status)) {
+            losses.ScheduledMessages++;
+            break;
+        }
+
+        own_buf[3] = status;
+        sched_add(own_buf[0] | ((uint32_t)own_buf[1] << 7) | ((uint32_t)own_buf[2] << 14),
+                  own_buf + 3, own_len - 3);
+        break;
+    }
+#endif
+    case SYSEX_GET_CONFIG:
+        reply_pending |= 1 << REPLY_CONFIG;
+        reply_cable[REPLY_CONFIG] = own_cable;
+        break;
+    case SYSEX_SET_CONFIG:
+        if (own_len == 2 * sizeof(config_new) && !config_pending)
+            config_pending = config_valid(&config_new);
+        break;
+    }
+}
+
+/* Send the replies that are waiting, unless a SysEx from the serial port
+ * is half way to the host. One that has stalled for REPLY_HOLD_TICKS is
+ * ended where it stands instead. */
+void
+reply_send (void)
+{
+    uint8_t *c = (uint8_t *)&config;
+    uint8_t i;
+
+    if (state >= STATE_SYSEX_0) {
+        if (!RingBuffer_IsEmpty(&serial_rx) || timestamp() - serial_time < REPLY_HOLD_TICKS)
+            return;
+        usb_write(0xf7);
+    }
+
+    if (reply_pending & (1 << REPLY_IDENTITY)) {
+        reply_to = reply_cable[REPLY_IDENTITY];
+        for (i = 0; i < sizeof(identity); i++)
+            reply_byte(pgm_read_byte(&identity[i]));
+    }
+
+    if (reply_pending & (1 << REPLY_CONFIG)) {
+        reply_to = reply_cable[REPLY_CONFIG];
+        reply_byte(0xf0);
+        reply_byte(SYSEX_ID_BRIDGE);
+        reply_byte(SYSEX_CONFIG);
+        for (i = 0; i < sizeof(config); i++) {
+            reply_byte(c[i] >> 4);
+            reply_byte(c[i] & 0x0f);
+        }
+        reply_byte(0xf7);
+    }
+
+    reply_pending = 0;
+}
+
+/* Take a packet from the host if it belongs to a SysEx of ours. */
+bool
+own_sysex (MIDI_EventPacket_t *event)
+{
+    uint8_t *d = &event->Data1;
+    uint8_t n, i;
+
+    if (own_cable == OWN_NONE) {
+        if (event->Command != 0x4 || d[0] != 0xf0)
+            return false;
+
+        if (d[1] == 0x7e && d[2] == 0x7f) {
+            own_held = *event;
+        } else if (d[1] != SYSEX_ID_BRIDGE) {
+            return false;
+        } else if (d[2] != SYSEX_GET_CONFIG && d[2] != SYSEX_SET_CONFIG
+#ifdef SCHEDULER
+                   && d[2] != SYSEX_SCHEDULE
+#endif
+                   ) {
+            return false;
+        }
+
+        own_cable = event->CableNumber;
+        own_kind = (d[1] == 0x7e) ? OWN_INQUIRY : d[2];
+        own_len = 0;
+        return true;
+    }
+
+    if (event->CableNumber != own_cable || event->Command == 0xf)
+        return false;
+
+    if (event->Command < 0x4 || event->Command > 0x7) {
+        /* A message which ends the SysEx without an F7. */
+        if (own_kind == OWN_INQUIRY)
+            usb_route(&own_held);
+        own_cable = OWN_NONE;
+        return false;
+    }
+
+    if (own_kind == OWN_INQUIRY) {
+        if (event->Command != 0x7 || d[0] != 0x06 || d[1] != 0x01) {
+            /* Some other Universal SysEx, which goes on as it is. */
+            own_cable = OWN_NONE;
+            usb_route(&own_held);
+            return false;
+        }
+
+        reply_pending |= 1 << REPLY_IDENTITY;
+        reply_cable[REPLY_IDENTITY] = own_cable;
+        own_cable = OWN_NONE;
+        return true;
+    }
+
+    n = pgm_read_byte(&cin_size[event->Command]);
+    for (i = 0; i < n; i++) {
+        if (d[i] == 0xf7) {
+            own_end();
+            own_cable = OWN_NONE;
+            break;
+        }
+        own_byte(d[i]);
+    }
+
+    return true;
+}
+#endif
+
+/* Read MIDI packets from USB and send them out again via UART. */
+void
+usb_read (MIDI_EventPacket_t *ReceivedMIDIEvent)
+{
+    boot_mark(BOOT_FIRST_MIDI);
+    trace(TRACE_RECV_PACKET, *(uint8_t *)ReceivedMIDIEvent);
+
+#if defined(LINK_MODE)
+    link_send(ReceivedMIDIEvent);
+#else
+    if (own_sysex(ReceivedMIDIEvent))
+        return;
+    usb_route(ReceivedMIDIEvent);
+#endif
+}
+
+/* Whether the host has sent a bank we have not read to the end yet. */
+bool
+usb_out_pending (void)
+{
+    if (USB_DeviceState != DEVICE_STATE_Configured)
+        return false;
+
+    Endpoint_SelectEndpoint(MIDI_STREAM_OUT_EPNUM);
+    return Endpoint_IsOUTReceived();
+}
+
+/* Read the next packet (or UMP word) of the OUT bank, releasing the bank
+ * to the host as soon as the last one is out. Packets are read one at a
+ * time and dispatched straight from the endpoint, which is selected again
+ * for each, as dispatching selects the IN endpoint. Trailing bytes short
+ * of a packet are dropped. */
+bool
+usb_out_next (uint32_t *word)
+{
+    if (!usb_out_pending())
+        return false;
+
+    if (Endpoint_BytesInEndpoint() < 4) {
+        Endpoint_ClearOUT();
+        return false;
+    }
+
+    *word = Endpoint_Read_DWord_LE();
+    if (Endpoint_BytesInEndpoint() < 4)
+        Endpoint_ClearOUT();
+
+    return true;
+}
+
+uint32_t ump_head;
+uint8_t ump_left;
+
+/* SysEx from the host's SysEx7 UMPs, packed back into event packets, so
+ * that it takes the same way as from a USB-MIDI 1.0 host: a SysEx of our
+ * own is answered, any other goes out via UART. */
+MIDI_EventPacket_t ump_out;
+uint8_t ump_out_len;
+
+void
+ump_out_byte (uint8_t b)
+{
+    uint8_t *d = &ump_out.Data1;
+
+    d[ump_out_len++] = b;
+
+    if (b == 0xf7)
+        ump_out.Command = 0x4 + ump_out_len;
+    else if (ump_out_len == 3)
+        ump_out.Command = 0x4;
+    else
+        return;
+
+    while (ump_out_len < 3)
+        d[ump_out_len++] = 0;
+    ump_out_len = 0;
+    ump_out.CableNumber = config.Cable;
+
+#ifdef LINK_MODE
+    serial_send(&ump_out);
+#else
+    if (!own_sysex(&ump_out))
+        usb_route(&ump_out);
+#endif
+}
+
+/* Take a SysEx7 UMP. A start drops whatever is left of a SysEx the host
+ * never ended. */
+void
+ump_read_sysex (uint32_t w0, uint32_t w1)
+{
+    uint8_t status = (w0 >> 20) & 0x0f;
+    uint8_t len = (w0 >> 16) & 0x0f;
+    uint8_t d[6] = { w0 >> 8, w0, w1 >> 24, w1 >> 16, w1 >> 8, w1 };
+    uint8_t i;
+
+    if (len > sizeof(d))
+        return;
+
+    if (status == UMP_SYSEX_COMPLETE || status == UMP_SYSEX_START) {
+        ump_out_len = 0;
+        ump_out_byte(0xf0);
+    }
+    for (i = 0; i < len; i++)
+        ump_out_byte(d[i] & 0x7f);
+    if (status == UMP_SYSEX_COMPLETE || status == UMP_SYSEX_END)
+        ump_out_byte(0xf7);
+}
+
+/* Read UMP words from USB and send the MIDI 1.0 messages in them out via
+ * UART. Anything that isn't for the configured cable's group, has no MIDI
+ * 1.0 byte stream equivalent or is filtered out is skipped. */
+void
+ump_read (uint32_t word)
+{
+    uint8_t status, d1, d2, n;
+
+    if (ump_left) {
+        if (--ump_left == 0 && (ump_head >> 28) == 0x3
+            && ((ump_head >> 24) & 0x0f) == config.Cable)
+            ump_read_sysex(ump_head, word);
+        return;
+    }
+
+    n = pgm_read_byte(&ump_words[word >> 28]);
+    if (n > 1) {
+        ump_head = word;
+        ump_left = n - 1;
+        return;
+    }
+
+    if (((word >> 24) & 0x0f) != config.Cable)
+        return;
+
+    boot_mark(BOOT_FIRST_MIDI);
+
+    status = word >> 16;
+    d1 = (word >> 8) & 0x7f;
+    d2 = word & 0x7f;
+
+    switch (word >> 28) {
+    case 0x1: /* system real time and system common */
+        if (!out_len[status >= 0xf8 ? 0xf : status == 0xf6 ? 0x5
+                     : status == 0xf2 ? 0x3 : 0x2])
+            break;
+        uart_tx(status);
+        if (status == 0xf1 || status == 0xf3) {
+            uart_tx(d1);
+        } else if (status == 0xf2) {
+            uart_tx(d1);
+            uart_tx(d2);
+        }
+        break;
+    case 0x2: /* MIDI 1.0 channel voice */
+        if (status < 0x80 || !out_len[status >> 4])
+            break;
+#ifdef TRANSFORMS
+        if (out_transform[status >> 4])
+            transform(&status, &d1, &d2);
+#endif
+#ifdef NOTE_TRACKER
+        track_note(status, d1, d2);
+#endif
+        uart_tx(status);
+        uart_tx(d1);
+        if (status < 0xc0 || status >= 0xe0)
+            uart_tx(d2);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Switch the streaming interface between USB-MIDI 1.0 event packets and
+ * UMP. */
+void
+ump_select (uint8_t altsetting)
+{
+    ump_enabled = (altsetting == MIDI_STREAM_UMP_ALTSETTING);
+    ump_left = 0;
+    ump_out_len = 0;
+    ump_sysex_len = 0;
+#ifndef LINK_MODE
+    /* A SysEx of ours doesn't carry over into the other format. */
+    own_cable = OWN_NONE;
+#endif
+    jr_clock_sent = timestamp() - JR_CLOCK_INTERVAL;
+
+    Endpoint_ResetFIFO(MIDI_STREAM_IN_EPNUM);
+    Endpoint_ResetFIFO(MIDI_STREAM_OUT_EPNUM);
+}
+
+/* Handle SET_INTERFACE and GET_INTERFACE for the streaming interface, whose
+ * alternate setting selects between MIDI 1.0 and UMP, and hand out its
+ * Group Terminal Blocks with the group set to the configured cable. A host
+ * that cached them sees a changed cable only after it enumerates again. */
+void
+interface_request (void)
+{
+    if (USB_ControlRequest.wIndex != Keyboard_MIDI_Interface.Config.StreamingInterfaceNumber)
+        return;
+
+    switch (USB_ControlRequest.bRequest) {
+    case REQ_SetInterface:
+        if (USB_ControlRequest.bmRequestType != (REQDIR_HOSTTODEVICE | REQTYPE_STANDARD | REQREC_INTERFACE)
+            || USB_ControlRequest.wValue > MIDI_STREAM_UMP_ALTSETTING)
+            return;
+
+#ifdef LINK_MODE
+        /* The link carries USB-MIDI 1.0 event packets only, so leave UMP
+         * requests to be stalled. */
+        if (USB_ControlRequest.wValue == MIDI_STREAM_UMP_ALTSETTING)
+            return;
+#endif
+
+        Endpoint_ClearSETUP();
+        Endpoint_ClearStatusStage();
+        ump_select(USB_ControlRequest.wValue);
+        break;
+    case REQ_GetInterface:
+        if (USB_ControlRequest.bmRequestType != (REQDIR_DEVICETOHOST | REQTYPE_STANDARD | REQREC_INTERFACE))
+            return;
+
+        Endpoint_ClearSETUP();
+        Endpoint_Write_Control_Stream_LE(&ump_enabled, 1);
+        Endpoint_ClearOUT();
+        break;
+    case REQ_GetDescriptor:
+        if (USB_ControlRequest.bmRequestType != (REQDIR_DEVICETOHOST | REQTYPE_STANDARD | REQREC_INTERFACE)
+            || USB_ControlRequest.wValue != ((MIDI2_DTYPE_CSGroupTerminalBlock << 8) | MIDI_STREAM_UMP_ALTSETTING))
+            return;
+
+        {
+            USB_Descriptor_GroupTerminalBlocks_t blocks;
+
+            memcpy_P(&blocks, &GroupTerminalBlocks, sizeof(blocks));
+            blocks.Block.FirstGroup = config.Cable;
+
+            Endpoint_ClearSETUP();
+            Endpoint_Write_Control_Stream_LE(&blocks, sizeof(blocks));
+            Endpoint_ClearOUT();
+        }
+        break;
+    }
+}
+
+/* Answer the bridge's own vendor requests, see MIDI_VendorRequests_t. */
+void
+vendor_request (void)
+{
+    if ((USB_ControlRequest.bmRequestType & (CONTROL_REQTYPE_TYPE | CONTROL_REQTYPE_RECIPIENT))
+        != (REQTYPE_VENDOR | REQREC_DEVICE))
+        return;
+
+    switch (USB_ControlRequest.bRequest) {
+    case REQ_GetBootTimes:
+        Endpoint_ClearSETUP();
+        Endpoint_Write_Control_Stream_LE(&boot_times, sizeof(boot_times));
+        Endpoint_ClearOUT();
+        break;
+    case REQ_SetDiagMode:
+        if (USB_ControlRequest.wValue > DIAG_UART_LOOP)
+            return;
+
+        Endpoint_ClearSETUP();
+        Endpoint_ClearStatusStage();
+        diag_select(USB_ControlRequest.wValue);
+        break;
+    case REQ_GetLossCounters:
+        Endpoint_ClearSETUP();
+        Endpoint_Write_Control_Stream_LE(&losses, sizeof(losses));
+        Endpoint_ClearOUT();
+        break;
+#ifdef NOTE_TRACKER
+    case REQ_AllNotesOff:
+        Endpoint_ClearSETUP();
+        Endpoint_ClearStatusStage();
+        notes_off_pending = true;
+        break;
+#endif
+    case REQ_GetConfig:
+        Endpoint_ClearSETUP();
+        Endpoint_Write_Control_Stream_LE(&config, sizeof(config));
+        Endpoint_ClearOUT();
+        break;
+    case REQ_SetConfig:
+        if (USB_ControlRequest.wLength != sizeof(config_new) || config_pending)
+            return;
+
+        Endpoint_ClearSETUP();
+        Endpoint_Read_Control_Stream_LE(&config_new, sizeof(config_new));
+        Endpoint_ClearIN();
+        config_pending = config_valid(&config_new);
+        break;
+#ifdef IDLE_SLEEP
+    case REQ_GetIdleStats:
+        Endpoint_ClearSETUP();
+        Endpoint_Write_Control_Stream_LE(&idle, sizeof(idle));
+        Endpoint_ClearOUT();
+        if (USB_ControlRequest.wValue == 1)
+            memset(&idle, 0, sizeof(idle));
+        break;
+#endif
+#ifdef PROFILE
+    case REQ_GetProfile:
+        Endpoint_ClearSETUP();
+        Endpoint_Write_Control_Stream_LE(&profile, sizeof(profile));
+        Endpoint_ClearOUT();
+        if (USB_ControlRequest.wValue == 1)
+            memset(&profile, 0, sizeof(profile));
+        break;
+#endif
+#ifdef TRACE
+    case REQ_SetTrace:
+        Endpoint_ClearSETUP();
+        Endpoint_ClearStatusStage();
+        Trace_Arm(&event_trace, USB_ControlRequest.wValue & 0x0f, USB_ControlRequest.wValue >> 8,
+                  USB_ControlRequest.wIndex, USB_ControlRequest.wIndex >> 8);
+        break;
+    case REQ_GetTrace:
+        Endpoint_ClearSETUP();
+        Endpoint_Write_Control_Stream_LE(&event_trace, sizeof(event_trace));
+        Endpoint_ClearOUT();
+        break;
+#endif
+    case REQ_GetDiagStats:
+        Endpoint_ClearSETUP();
+        Endpoint_Write_Control_Stream_LE(&diag, sizeof(diag));
+        Endpoint_ClearOUT();
+        break;
+    case REQ_GetTime:
+        {
+            uint32_t now = timestamp();
+
+            Endpoint_ClearSETUP();
+            Endpoint_Write_Control_Stream_LE(&now, sizeof(now));
+            Endpoint_ClearOUT();
+        }
+        break;
+    }
+}
+
+/* The main loop shares its time between the two directions by deficit
+ * round robin. Each round, a direction with a backlog is served for up to
+ * its quantum, in bytes for serial input and in packets for host output.
+ * Host output that had to give way early keeps the rest of its deficit
+ * for the next round. A direction is served for its whole backlog while
+ * the other one is idle. */
+#define SERIAL_QUANTUM 16
+#define OUT_QUANTUM 4
+
+uint8_t out_deficit;
+
+/* Pass on n bytes from the serial input ring. */
+void
+serve_serial (uint8_t n)
+{
+#ifndef LINK_MODE
+    uint32_t now = timestamp();
+#endif
+
+    while (n--) {
+        uint8_t b;
+#ifndef LINK_MODE
+        /* Go back from now by the byte's age, which is taken modulo the
+         * 16ms the stamp covers. */
+        uint8_t age = (uint8_t)(now >> 7) - serial_rx_time[serial_rx.Out & (BUFFER_SIZE - 1)];
+
+        serial_time = (now & ~0x7fUL) - ((uint32_t)age << 7);
+#endif
+        b = RingBuffer_Remove(&serial_rx);
+
+        /* The UART loop owns the parser, so real input is dropped. */
+        if (diag.Mode == DIAG_UART_LOOP)
+            continue;
+#ifdef LINK_MODE
+        link_receive(b);
+#else
+        usb_write(b);
+#endif
+    }
+}
+
+#ifdef NOTE_TRACKER
+/* Release every held note, using running status so each one costs two
+ * bytes on the wire. Scheduled messages are dropped first, all but the
+ * rest of one already going out, so none can start a note after this.
+ * Sending them all can keep the UART busy for long, so serial input is
+ * passed on after each message. */
+void
+notes_off (void)
+{
+    uint8_t channel, i;
+
+#ifdef SCHEDULER
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        sched_count = 0;
+        TIMSK1 &= ~(1 << OCIE1B);
+        sched_tx.In = sched_tx.Out + sched_left;
+    }
+#endif
+
+    for (channel = 0; channel < 16; channel++) {
+        bool status_sent = false;
+
+        for (i = 0; i < held_notes.Count; i++) {
+            if (held_notes.Channel[i] != channel)
+                continue;
+            if (!status_sent) {
+                uart_tx(0x80 | channel);
+                status_sent = true;
+            }
+            uart_tx(held_notes.Note[i]);
+            uart_tx(0);
+            serve_serial(RingBuffer_GetCount(&serial_rx));
+        }
+
+        /* Notes the tracker had no room for. */
+        if (held_notes.Overflowed & (1 << channel)) {
+            uart_tx(0xb0 | channel);
+            uart_tx(123);
+            uart_tx(0);
+            serve_serial(RingBuffer_GetCount(&serial_rx));
+        }
+    }
+
+    NoteTracker_Init(&held_notes);
+}
+#endif
+
+/* A packet from the host, in whichever format the alternate setting in
+ * use has. */
+typedef union {
+    MIDI_EventPacket_t Event;
+    uint32_t Word;
+} out_packet_t;
+
+/* Dispatch the next packet from the host. Returns false if there is none. */
+bool
+out_dispatch (void)
+{
+    out_packet_t p;
+    bool ump, read;
+
+    /* A SET_INTERFACE in between would flush the bank and switch formats
+     * under us. */
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ump = ump_enabled;
+        read = usb_out_next(&p.Word);
+    }
+    if (!read)
+        return false;
+
+    if (diag.Mode == DIAG_USB_ECHO) {
+        if (ump)
+            ump_send_words(&p.Word, 1);
+        else if (MIDI_Device_SendEventPacket(&Keyboard_MIDI_Interface, &p.Event))
+            losses.USBPackets++;
+        in_dirty = true;
+        diag.Packets++;
+        diag.Bytes += sizeof(p);
+    } else if (ump) {
+        ump_read(p.Word);
+    } else {
+        usb_read(&p.Event);
+    }
+
+    return true;
+}
+
+/* Dispatch up to n packets from the host, counting held packets released
+ * by the merge as well. Gives way early when the serial input ring fills
+ * up, which bounds the time serial input waits to one packet's worth of
+ * work. Returns the number of packets dispatched. */
+uint8_t
+serve_out (uint8_t n)
+{
+    uint8_t served = 0;
+
+    while (served < n) {
+        bool sent = false;
+
+#ifdef MERGE_CABLES
+        if (merge_draining)
+            sent = merge_drain();
+#endif
+        if (!sent && !out_dispatch())
+            break;
+
+        served++;
+
+        if (RingBuffer_GetCount(&serial_rx) >= BUFFER_NEARLY_FULL)
+            break;
+    }
+
+    return served;
+}
+
+#ifdef IDLE_SLEEP
+/* Idle sleep. With nothing left to do, the main loop sleeps until the next
+ * interrupt: a byte from the USART, a start of frame from the host every
+ * millisecond while the bus is active, the timer, or a control request.
+ * Packets from the host are picked up on the next start of frame, as the
+ * OUT endpoint interrupt would only spin in the USB driver's handler. */
+
+/* When the main loop last woke up, if it has not passed on any data since. */
+uint16_t idle_wake;
+bool idle_woke;
+
+/* Whether there is nothing to do until the next interrupt. Called with
+ * interrupts off, so nothing can arrive between the check and the sleep. */
+bool
+idle_ready (void)
+{
+    if (!RingBuffer_IsEmpty(&serial_rx) || in_dirty
+        || config_pending || diag.Mode != DIAG_OFF)
+        return false;
+#ifdef NOTE_TRACKER
+    if (notes_off_pending)
+        return false;
+#endif
+#ifdef MERGE_CABLES
+    if (merge_reset_pending || merge_draining)
+        return false;
+#endif
+#ifndef LINK_MODE
+    if (reply_pending)
+        return false;
+#endif
+
+    return !usb_out_pending();
+}
+
+void
+idle_sleep (void)
+{
+    uint32_t start;
+
+    cli();
+    if (!idle_ready()) {
+        sei();
+        return;
+    }
+
+    start = timestamp();
+    sleep_enable();
+    /* The instruction after sei always runs before a pending interrupt. */
+    sei();
+    sleep_cpu();
+    sleep_disable();
+
+    idle_wake = timer_read();
+    idle_woke = true;
+    idle.Sleeps++;
+    idle.SleepTicks += timestamp() - start;
+}
+
+/* Data has been passed on, see how long it took since waking up. */
+void
+idle_forwarded (void)
+{
+    uint16_t t;
+
+    if (!idle_woke)
+        return;
+
+    idle_woke = false;
+    t = timer_read() - idle_wake;
+    if (t > idle.WorstWakeLatency)
+        idle.WorstWakeLatency = t;
+}
+#endif
+
+/** Main program entry point. This routine contains the overall program flow, including initial
+ *  setup of all components and the main program loop.
+ */
+int main(void)
+{
+    SetupHardware();
+
+    for (;;) {
+        profile_start(loop);
+        RingBuff_Count_t backlog = RingBuffer_GetCount(&serial_rx);
+        uint8_t n;
+
+        if (backlog) {
+            profile_start(t);
+            /* Past the mark, input could be lost before the next round. */
+            if (backlog < BUFFER_NEARLY_FULL && backlog > SERIAL_QUANTUM && usb_out_pending())
+                backlog = SERIAL_QUANTUM;
+            serve_serial(backlog);
+            profile_end(PROFILE_SERIAL, t);
+#ifdef IDLE_SLEEP
+            idle_forwarded();
+#endif
+        }
+
+        /* Hand serial input to the host before serving the host's
+         * output, which can take a few milliseconds of UART time. */
+        if (in_dirty) {
+            profile_start(t);
+            in_dirty = false;
+            MIDI_Device_Flush(&Keyboard_MIDI_Interface);
+            profile_end(PROFILE_FLUSH, t);
+        }
+
+        if (RingBuffer_IsEmpty(&serial_rx))
+            out_deficit = MIDI_STREAM_EPSIZE / 4;
+        else if ((out_deficit += OUT_QUANTUM) > 2 * OUT_QUANTUM)
+            out_deficit = 2 * OUT_QUANTUM;
+
+        {
+            profile_start(t);
+            n = serve_out(out_deficit);
+            profile_end(PROFILE_USB_OUT, t);
+        }
+#ifdef IDLE_SLEEP
+        if (n)
+            idle_forwarded();
+#endif
+        out_deficit = usb_out_pending() ? out_deficit - n : 0;
+
+#ifndef LINK_MODE
+        if (reply_pending)
+            reply_send();
+#endif
+
+        /* Echoes and replies to the host's packets. */
+        if (in_dirty) {
+            profile_start(t);
+            in_dirty = false;
+            MIDI_Device_Flush(&Keyboard_MIDI_Interface);
+            profile_end(PROFILE_FLUSH, t);
+        }
+
+        profile_start(housekeeping);
+
+        if (diag.Mode != DIAG_OFF)
+            diag_tick();
+
+        if (config_pending)
+            config_save();
+
+#ifdef NOTE_TRACKER
+        if (notes_off_pending) {
+            notes_off_pending = false;
+            notes_off();
+#ifdef MERGE_CABLES
+            /* The note offs broke any open SysEx and the wire's running
+             * status. */
+            merge_reset();
+#endif
+        }
+#endif
+#ifdef MERGE_CABLES
+        if (merge_reset_pending) {
+            merge_reset_pending = false;
+            merge_reset();
+        }
+#endif
+
+        profile_end(PROFILE_HOUSEKEEPING, housekeeping);
+
+        {
+            profile_start(t);
+            MIDI_Device_USBTask(&Keyboard_MIDI_Interface);
+            profile_end(PROFILE_MIDI_TASK, t);
+        }
+        {
+            profile_start(t);
+            USB_USBTask();
+            profile_end(PROFILE_USB_TASK, t);
+        }
+
+#ifdef PROFILE
+        loop = timer_read() - loop;
+        profile.Loops++;
+        if (loop > profile.WorstLoop)
+            profile.WorstLoop = loop;
+#endif
+
+#ifdef IDLE_SLEEP
+        idle_sleep();
+#endif
+    }
+}
+
+/** Configures the board hardware and chip peripherals for the demo's functionality. */
+void SetupHardware(void)
+{
+    /* Disable watchdog if enabled by bootloader/fuses */
+    MCUSR &= ~(1 << WDRF);
+    wdt_disable();
+
+    /* Disable clock division */
+    //clock_prescale_set(clock_div_1);
+
+    /* Hardware Initialization */
+    timer_init();
+    LEDs_Init();
+    LEDs_SetAllLEDs(LEDMASK_USB_NOTREADY);
+
+    /* Attach to the bus before the rest of the initialisation. This only
+     * gains the few microseconds of the USART setup, next to the 100ms the
+     * host waits after a connect before it starts enumerating. */
+    USB_Init();
+    sei();
+    boot_mark(BOOT_USB_ATTACHED);
+
+    config_load();
+    RingBuffer_InitBuffer(&serial_rx);
+    RingBuffer_InitBuffer(&serial_tx);
+    Serial_Init(config.Baud, false);
+    UCSR1B |= (1 << RXCIE1);
+    boot_mark(BOOT_SERIAL_READY);
+
+#ifdef IDLE_SLEEP
+    set_sleep_mode(SLEEP_MODE_IDLE);
+#endif
 }
 
 /** Event handler for the library USB Connection event. */
 void EVENT_USB_Device_Connect(void)
 {
+    boot_mark(BOOT_CONNECTED);
     LEDs_SetAllLEDs(LEDMASK_USB_ENUMERATING);
 }
 
@@ -309,6 +2405,18 @@ void EVENT_USB_Device_Connect(void)
 void EVENT_USB_Device_Disconnect(void)
 {
     LEDs_SetAllLEDs(LEDMASK_USB_NOTREADY);
+
+#ifdef NOTE_TRACKER
+    notes_off_pending = true;
+#endif
+}
+
+/** Event handler for the library USB Suspend event. */
+void EVENT_USB_Device_Suspend(void)
+{
+#ifdef NOTE_TRACKER
+    notes_off_pending = true;
+#endif
 }
 
 /** Event handler for the library USB Configuration Changed event. */
@@ -318,12 +2426,32 @@ void EVENT_USB_Device_ConfigurationChanged(void)
 
     ConfigSuccess &= MIDI_Device_ConfigureEndpoints(&Keyboard_MIDI_Interface);
 
+    if (ConfigSuccess)
+        boot_mark(BOOT_CONFIGURED);
+
+    ump_select(0);
+#ifdef MERGE_CABLES
+    merge_reset_pending = true;
+#endif
+#ifdef IDLE_SLEEP
+    USB_Device_EnableSOFEvents();
+#endif
+
     LEDs_SetAllLEDs(ConfigSuccess ? LEDMASK_USB_READY : LEDMASK_USB_ERROR);
 }
 
+/** Event handler for the library USB Start of Frame event. Its interrupt only serves to wake the
+ *  main loop from idle sleep, so packets from the host are picked up within a frame.
+ */
+void EVENT_USB_Device_StartOfFrame(void)
+{
+}
+
 /** Event handler for the library USB Control Request reception event. */
 void EVENT_USB_Device_ControlRequest(void)
 {
+    interface_request();
+    vendor_request();
     MIDI_Device_ProcessControlRequest(&Keyboard_MIDI_Interface);
 }
 
@@ -41,6 +41,9 @@
 		#include <avr/wdt.h>
 		#include <avr/power.h>
 		#include <avr/interrupt.h>
+		#include <avr/eeprom.h>
+		#include <avr/sleep.h>
+		#include <util/atomic.h>
 		#include <stdbool.h>
 		#include <string.h>
 
@@ -63,13 +66,225 @@
         /** LED mask for the library LED driver, to indicate that an error has occurred in the USB interface. */
         #define LEDMASK_USB_ERROR        (LEDS_LED1 | LEDS_LED3)
 
+        /** Number of \ref timestamp() ticks per millisecond. Timer 1 runs at F_CPU/8, so one tick is 0.5us. */
+        #define TICKS_PER_MS             (F_CPU / 8 / 1000)
+
+        /** Layout version of \ref MIDI_Config_t. A stored configuration with any other version is ignored. */
+        #define MIDI_CONFIG_VERSION      2
+
+        /** SysEx manufacturer ID of the bridge's own messages, the one set aside for non-commercial use. */
+        #define SYSEX_ID_BRIDGE          0x7D
+
+        /** Sub-ID of a scheduled message, sent by the host as F0 7D 01 t0 t1 t2 msg F7. The three 7-bit
+         *  groups t0 (lowest) to t2 hold the 21-bit device time to send msg at, in units of 64
+         *  \ref timestamp() ticks (32us). msg is one complete message of up to three bytes, starting with
+         *  its status byte with bit 7 cleared, so that the SysEx stays 7-bit clean. SysEx (F0, F7) and the
+         *  undefined F4 and F5 can't be scheduled. Times up to about 33 seconds in the past are sent at
+         *  once (SCHEDULER builds only).
+         */
+        #define SYSEX_SCHEDULE           0x01
+
+        /** Sub-ID of a request for the configuration, sent by the host as F0 7D 02 F7. The bridge answers
+         *  with a \ref SYSEX_CONFIG message.
+         */
+        #define SYSEX_GET_CONFIG         0x02
+
+        /** Sub-ID of the bridge's answer to \ref SYSEX_GET_CONFIG, F0 7D 03 data F7. The data holds the
+         *  \ref MIDI_Config_t in use as two bytes per byte, high nibble first.
+         */
+        #define SYSEX_CONFIG             0x03
+
+        /** Sub-ID of a new configuration sent by the host, F0 7D 04 data F7, with the data laid out as in
+         *  \ref SYSEX_CONFIG. It is taken the same way as with REQ_SetConfig.
+         */
+        #define SYSEX_SET_CONFIG         0x04
+
+    /* Enums: */
+        /** Vendor specific control requests understood by the bridge. All requests are addressed to the
+         *  device recipient, and return their data in little endian byte order.
+         */
+        enum MIDI_VendorRequests_t
+        {
+            REQ_GetBootTimes = 0x01, /**< Returns the \ref MIDI_BootTimes_t startup phase times. */
+            REQ_SetDiagMode  = 0x02, /**< Selects the \ref MIDI_DiagModes_t mode given in wValue, and clears the statistics. */
+            REQ_GetDiagStats = 0x03, /**< Returns the \ref MIDI_DiagStats_t statistics of the current diagnostic mode. */
+            REQ_GetLossCounters = 0x04, /**< Returns the \ref MIDI_LossCounters_t counters since power-on. */
+            REQ_AllNotesOff  = 0x05, /**< Sends a note off for every note held on the serial port (NOTE_TRACKER builds only). */
+            REQ_GetConfig    = 0x06, /**< Returns the \ref MIDI_Config_t configuration in use. */
+            REQ_SetConfig    = 0x07, /**< Takes a \ref MIDI_Config_t configuration, applies it and stores it in EEPROM. */
+            REQ_SetTrace     = 0x08, /**< Clears and re-arms the event trace (TRACE builds only). wValue holds the
+                                      *   \ref MIDI_TraceKinds_t kind to trigger on in the low byte and the value in
+                                      *   the high byte, wIndex the value mask in the low byte and the number of
+                                      *   records to keep after the trigger in the high byte.
+                                      */
+            REQ_GetTrace     = 0x09, /**< Returns the event trace as a Trace_t (TRACE builds only). */
+            REQ_GetTime      = 0x0A, /**< Returns the current 32-bit \ref timestamp(), to line up scheduled output. */
+            REQ_GetProfile   = 0x0B, /**< Returns the \ref MIDI_Profile_t counters, and clears them if wValue is 1 (PROFILE builds only). */
+            REQ_GetIdleStats = 0x0C, /**< Returns the \ref MIDI_IdleStats_t statistics, and clears them if wValue is 1 (IDLE_SLEEP builds only). */
+        };
+
+        /** Velocity curves of the transform stage, see \ref MIDI_Config_t. */
+        enum MIDI_VelocityCurves_t
+        {
+            VELOCITY_LINEAR = 0, /**< Velocities are passed on unchanged. */
+            VELOCITY_SOFT   = 1, /**< Low velocities are raised, for a lighter touch. */
+            VELOCITY_HARD   = 2, /**< Low velocities are lowered, for a heavier touch. */
+            VELOCITY_FIXED  = 3, /**< Every non-zero velocity becomes VelocityValue. */
+        };
+
+        /** Directions the transform stage applies to, as a mask in \ref MIDI_Config_t. */
+        enum MIDI_TransformDirections_t
+        {
+            TRANSFORM_TO_USB    = (1 << 0), /**< Transform messages from the serial port to USB. */
+            TRANSFORM_TO_SERIAL = (1 << 1), /**< Transform messages from USB to the serial port. */
+        };
+
+        /** Kinds of event trace records. The high nibble of a record's kind holds the low bits of the
+         *  timer overflow count, which extends its 0.5us time stamp to a range of about half a second.
+         */
+        enum MIDI_TraceKinds_t
+        {
+            TRACE_SERIAL_BYTE  = 1, /**< A byte from the serial port reached the parser, value is the byte. */
+            TRACE_PARSER_STATE = 2, /**< The parser changed state, value is the old state in the high nibble and the new one in the low nibble. */
+            TRACE_SYSEX_ABORT  = 3, /**< A status byte interrupted a SysEx from the serial port, value is the status. */
+            TRACE_SENT_PACKET  = 4, /**< An event packet was sent to the host, value is its cable number and CIN byte. */
+            TRACE_RECV_PACKET  = 5, /**< An event packet was received from the host, value is its cable number and CIN byte. */
+        };
+
+        /** Diagnostic loopback modes, which take one half of the bridge out of the picture so the
+         *  throughput of the other half can be measured on its own.
+         */
+        enum MIDI_DiagModes_t
+        {
+            DIAG_OFF       = 0, /**< Normal operation. */
+            DIAG_USB_ECHO  = 1, /**< Event packets from the OUT endpoint are sent straight back to the IN endpoint. */
+            DIAG_UART_LOOP = 2, /**< Bytes meant for the UART are fed back into the serial parser, serial input is dropped. */
+        };
+
+        /** Stages of the main loop and interrupts timed by the profiler. The interrupts of the USB
+         *  driver cannot be timed from here, their time is counted in whichever stage they interrupted,
+         *  as is the time of the interrupts below.
+         */
+        enum MIDI_ProfileStages_t
+        {
+            PROFILE_SERIAL       = 0, /**< Serial input passed on from the receive ring. */
+            PROFILE_USB_OUT      = 1, /**< Packets from the host, fetched from the OUT endpoint and dispatched. */
+            PROFILE_FLUSH        = 2, /**< Flushing the IN endpoint. */
+            PROFILE_HOUSEKEEPING = 3, /**< Diagnostics, configuration saving and pending note offs. */
+            PROFILE_MIDI_TASK    = 4, /**< MIDI_Device_USBTask(). */
+            PROFILE_USB_TASK     = 5, /**< USB_USBTask(). */
+            PROFILE_USART_RX     = 6, /**< USART receive interrupt. */
+            PROFILE_USART_UDRE   = 7, /**< USART data register empty interrupt. */
+            PROFILE_TIMER        = 8, /**< Timer 1 overflow and compare interrupts. */
+            PROFILE_STAGES       = 9, /**< Number of timed stages. */
+        };
+
+        /** Startup phases whose completion time is recorded by the firmware, see \ref MIDI_BootTimes_t. */
+        enum MIDI_BootPhases_t
+        {
+            BOOT_USB_ATTACHED = 0, /**< USB_Init() returned, the device is attached to the bus. */
+            BOOT_SERIAL_READY = 1, /**< The USART has been initialised. */
+            BOOT_CONNECTED    = 2, /**< The host has connected to the device. */
+            BOOT_CONFIGURED   = 3, /**< The host has selected the configuration, MIDI endpoints are ready. */
+            BOOT_FIRST_MIDI   = 4, /**< The first MIDI event has been bridged in either direction. */
+            BOOT_PHASES       = 5, /**< Number of recorded phases. */
+        };
+
+    /* Type Defines: */
+        /** Type define for the statistics of the current diagnostic mode, as returned by REQ_GetDiagStats. */
+        typedef struct
+        {
+            uint8_t  Mode;       /**< Current \ref MIDI_DiagModes_t mode. */
+            uint32_t Packets;    /**< Event packets looped since the mode was selected. */
+            uint32_t Bytes;      /**< Bytes looped since the mode was selected. */
+            uint32_t PacketRate; /**< Packets looped during the last full second. */
+            uint32_t ByteRate;   /**< Bytes looped during the last full second. */
+        } MIDI_DiagStats_t;
+
+        /** Type define for the startup phase times, as returned by REQ_GetBootTimes. A phase whose bit is
+         *  clear in Reached has not been reached yet, and its time is meaningless.
+         */
+        typedef struct
+        {
+            uint32_t Times[BOOT_PHASES]; /**< \ref timestamp() at which each \ref MIDI_BootPhases_t phase was reached. */
+            uint8_t  Reached;            /**< Mask of the phases reached so far, bit n for phase n. */
+        } MIDI_BootTimes_t;
+
+        /** Type define for the counters of data the bridge had to drop, as returned by REQ_GetLossCounters.
+         *  A load the bridge sustains without loss leaves all of them at zero.
+         */
+        typedef struct
+        {
+            uint16_t SerialOverruns;    /**< Bytes lost because the USART receiver overran. */
+            uint16_t SerialFrameErrors; /**< Bytes received with a framing error. */
+            uint16_t USBPackets;        /**< Packets that could not be written to the IN endpoint. */
+            uint16_t LinkFrames;        /**< Link mode frames dropped as truncated or corrupt. */
+            uint16_t MergePackets;      /**< Packets dropped in merge mode because the hold queue was full, or with the rest of such a message. */
+            uint16_t ScheduledMessages; /**< Scheduled messages dropped because the schedule was full or they were malformed. */
+        } MIDI_LossCounters_t;
+
+        /** Type define for the time spent in one \ref MIDI_ProfileStages_t stage. Times are in
+         *  \ref timestamp() ticks of 8 CPU cycles.
+         */
+        typedef struct
+        {
+            uint32_t Ticks; /**< Total time spent in the stage. */
+            uint16_t Calls; /**< Number of times the stage ran, wrapping around. */
+            uint16_t Worst; /**< Longest single run of the stage. */
+        } MIDI_ProfileStage_t;
+
+        /** Type define for the profiler counters, as returned by REQ_GetProfile. */
+        typedef struct
+        {
+            MIDI_ProfileStage_t Stages[PROFILE_STAGES]; /**< Time spent in each stage. */
+            uint32_t            Loops;                  /**< Main loop iterations. */
+            uint16_t            WorstLoop;              /**< Longest main loop iteration, in ticks. */
+        } MIDI_Profile_t;
+
+        /** Type define for the idle sleep statistics, as returned by REQ_GetIdleStats. Times are in
+         *  \ref timestamp() ticks.
+         */
+        typedef struct
+        {
+            uint32_t Sleeps;           /**< Number of times the main loop went to sleep. */
+            uint32_t SleepTicks;       /**< Total time spent asleep. */
+            uint16_t WorstWakeLatency; /**< Longest time from waking up to having passed on the data that woke the bridge. */
+        } MIDI_IdleStats_t;
+
+        /** Type define for the bridge configuration, which is kept in EEPROM and read and written by the
+         *  host with REQ_GetConfig and REQ_SetConfig. A new configuration takes effect as soon as it is
+         *  received, except for the baud rate, which is only used from the next power up. It is written
+         *  to EEPROM a byte at a time in the background, taking around 120ms, and a further configuration
+         *  is refused until that has finished.
+         */
+        typedef struct
+        {
+            uint8_t  Version;   /**< Must be \ref MIDI_CONFIG_VERSION. */
+            uint8_t  Cable;     /**< Cable number (or UMP group, as advertised in the Group Terminal Block) of the serial port. */
+            uint16_t CableMask; /**< Cables from USB forwarded to the serial port, one bit per cable. */
+            uint16_t InFilter;  /**< Packets from the serial port sent to USB, one bit per CIN. */
+            uint16_t OutFilter; /**< Packets from USB sent to the serial port, one bit per CIN. */
+            uint32_t Baud;      /**< USART baud rate. */
+
+            /* Transform stage, only used when built with TRANSFORMS */
+            uint8_t  TransformDirections; /**< Mask of \ref MIDI_TransformDirections_t values. */
+            uint8_t  ChannelMap[16];      /**< Output channel for each input channel, 0 to 15. */
+            int8_t   Transpose;           /**< Semitones added to note numbers. */
+            uint8_t  NoteLow;             /**< Lowest note number after transposing, lower ones are clamped. */
+            uint8_t  NoteHigh;            /**< Highest note number after transposing, higher ones are clamped. */
+            uint8_t  VelocityCurve;       /**< One of \ref MIDI_VelocityCurves_t. */
+            uint8_t  VelocityValue;       /**< Velocity used by VELOCITY_FIXED. */
+        } MIDI_Config_t;
+
     /* Function Prototypes: */
         void SetupHardware(void);
 
         void EVENT_USB_Device_Connect(void);
         void EVENT_USB_Device_Disconnect(void);
+        void EVENT_USB_Device_Suspend(void);
         void EVENT_USB_Device_ConfigurationChanged(void);
         void EVENT_USB_Device_ControlRequest(void);
+        void EVENT_USB_Device_StartOfFrame(void);
 
 #endif
 
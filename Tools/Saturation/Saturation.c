@@ -0,0 +1,426 @@
+/*
+ * Saturation harness for the USB-MIDI <-> Serial MIDI converter.
+ *
+ * Runs the built firmware in simavr and loads both directions at once:
+ * the USART receiver gets back to back Note On messages at the full
+ * 31250 baud line rate, while the OUT endpoint is offered a fixed number
+ * of event packets per 1ms USB frame. Every message is numbered, so the
+ * far side of each direction (the IN endpoint and the USART transmitter)
+ * can check that nothing was lost, duplicated or reordered. The offered
+ * OUT load is stepped up in eighths of an event per frame; for each step
+ * the harness prints what was carried and lost, plus the firmware's own
+ * REQ_GetLossCounters.
+ *
+ * A NAK on the OUT endpoint is not loss: the host queues the packet and
+ * offers it again in a later slot, exactly as a real host controller
+ * would. But a load the bridge only keeps up with by NAKing is not
+ * sustained either. A step saturates when more than a frame's worth of
+ * offered packets is still queued at its end, that is when the accepted
+ * rate falls behind the offered one. The highest sustained load is the
+ * highest step that neither saturates nor loses data.
+ *
+ * simavr has no ATmega8U2 core, so the firmware is built for the
+ * register compatible AT90USB162 instead (see the makefile next to this
+ * file). Only the default build is supported; link mode frames the
+ * USART differently and is not modelled here.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_cycle_timers.h>
+#include <simavr/avr_uart.h>
+#include <simavr/avr_usb.h>
+
+#define F_CPU            16000000
+#define IN_EPNUM         2    /* MIDI_STREAM_IN_EPNUM */
+#define OUT_EPNUM        1    /* MIDI_STREAM_OUT_EPNUM */
+#define REQ_LOSSES       0x04 /* REQ_GetLossCounters */
+#define SLOTS            16   /* bus slots per frame, one OUT transaction each */
+#define BYTE_USEC        320  /* 10 bits at 31250 baud */
+#define DRAIN_FRAMES     100
+#define STEP             8    /* load steps per event per frame */
+
+typedef struct {
+    uint16_t SerialOverruns;
+    uint16_t SerialFrameErrors;
+    uint16_t USBPackets;
+    uint16_t LinkFrames;
+    uint16_t MergePackets;
+    uint16_t ScheduledMessages;
+} __attribute__((packed)) losses_t;
+
+/* One numbered message stream: the sender numbers Note Ons, the
+ * receiver checks they arrive in sequence. */
+typedef struct {
+    uint32_t sent;
+    uint32_t received;
+    uint32_t errors;
+} stream_t;
+
+typedef struct {
+    uint32_t offered;
+    uint32_t accepted;
+    uint32_t queued;
+    uint32_t naks;
+    bool     saturated;
+    stream_t serial_to_usb;
+    stream_t usb_to_serial;
+    losses_t losses;
+    bool     lossless;
+} result_t;
+
+static avr_t *avr;
+static avr_irq_t *uart_in;
+static bool feeding;
+static uint8_t feed_pos;
+static result_t *result;
+
+/* USART transmitter parser state, tolerating running status. */
+static uint8_t tx_status, tx_data[2], tx_pos;
+
+static uint8_t
+seq_note (uint32_t seq)
+{
+    return seq & 0x7f;
+}
+
+static uint8_t
+seq_velocity (uint32_t seq)
+{
+    return 1 + (seq >> 7) % 127;
+}
+
+static void
+stream_check (stream_t *s, uint8_t note, uint8_t velocity)
+{
+    if (note != seq_note(s->received) || velocity != seq_velocity(s->received))
+        s->errors++;
+    s->received++;
+}
+
+static void
+run_usec (uint32_t usec)
+{
+    avr_cycle_count_t end = avr->cycle + avr_usec_to_cycles(avr, usec);
+
+    while (avr->cycle < end) {
+        int state = avr_run(avr);
+        if (state == cpu_Done || state == cpu_Crashed) {
+            fprintf(stderr, "firmware stopped (state %d)\n", state);
+            exit(2);
+        }
+    }
+}
+
+/* Feeds one byte to the USART receiver every byte time, for as long as
+ * the load is on. */
+static avr_cycle_count_t
+serial_feed (avr_t *a, avr_cycle_count_t when, void *param)
+{
+    stream_t *s = &result->serial_to_usb;
+    uint8_t b;
+
+    if (!feeding && feed_pos == 0)
+        return 0;
+
+    switch (feed_pos) {
+    case 0: b = 0x90; break;
+    case 1: b = seq_note(s->sent); break;
+    default: b = seq_velocity(s->sent); s->sent++; break;
+    }
+    feed_pos = (feed_pos + 1) % 3;
+    avr_raise_irq(uart_in, b);
+
+    return when + avr_usec_to_cycles(a, BYTE_USEC);
+}
+
+static void
+serial_out (struct avr_irq_t *irq, uint32_t value, void *param)
+{
+    uint8_t b = value;
+
+    if (b >= 0xf8)
+        return;
+    if (b & 0x80) {
+        tx_status = b;
+        tx_pos = 0;
+        return;
+    }
+    tx_data[tx_pos++] = b;
+    if (tx_pos < 2)
+        return;
+    tx_pos = 0;
+    if (tx_status == 0x90)
+        stream_check(&result->usb_to_serial, tx_data[0], tx_data[1]);
+    else
+        result->usb_to_serial.errors++;
+}
+
+/* Offers one transaction to the device; returns the simavr status. */
+static int
+usb_io (unsigned long request, uint8_t ep, uint8_t *buf, uint32_t *len)
+{
+    struct avr_io_usb io = { .pipe = ep, .sz = *len, .buf = buf };
+    int ret = avr_ioctl(avr, request, &io);
+
+    *len = io.sz;
+    return ret;
+}
+
+/* Retries a transaction the device NAKs, letting the firmware run in
+ * between, as the host controller would. */
+static int
+usb_io_wait (unsigned long request, uint8_t ep, uint8_t *buf, uint32_t *len)
+{
+    for (int tries = 0; tries < 10000; tries++) {
+        uint32_t n = *len;
+        int ret = usb_io(request, ep, buf, &n);
+        if (ret != AVR_IOCTL_USB_NAK) {
+            *len = n;
+            return ret;
+        }
+        run_usec(10);
+    }
+    return AVR_IOCTL_USB_NAK;
+}
+
+static int
+usb_control (uint8_t type, uint8_t request, uint16_t value, uint16_t index,
+             uint8_t *data, uint16_t length)
+{
+    uint8_t setup[8] = { type, request, value, value >> 8, index, index >> 8,
+                         length, length >> 8 };
+    uint32_t n = sizeof(setup);
+
+    if (usb_io_wait(AVR_IOCTL_USB_SETUP, 0, setup, &n) != AVR_IOCTL_USB_OK)
+        return -1;
+
+    if (type & 0x80) {
+        uint16_t got = 0;
+        while (got < length) {
+            n = length - got;
+            if (usb_io_wait(AVR_IOCTL_USB_READ, 0, data + got, &n) != AVR_IOCTL_USB_OK)
+                return -1;
+            got += n;
+            if (n < 8)
+                break;
+        }
+        n = 0;
+        return usb_io_wait(AVR_IOCTL_USB_WRITE, 0, NULL, &n) == AVR_IOCTL_USB_OK ? got : -1;
+    }
+
+    n = 0;
+    return usb_io_wait(AVR_IOCTL_USB_READ, 0, NULL, &n) == AVR_IOCTL_USB_OK ? 0 : -1;
+}
+
+static void
+usb_poll_in (void)
+{
+    uint8_t buf[64];
+    uint32_t n = sizeof(buf);
+
+    if (usb_io(AVR_IOCTL_USB_READ, IN_EPNUM, buf, &n) != AVR_IOCTL_USB_OK)
+        return;
+
+    for (uint32_t i = 0; i + 4 <= n; i += 4) {
+        if (buf[i] == 0x09 && buf[i + 1] == 0x90)
+            stream_check(&result->serial_to_usb, buf[i + 2], buf[i + 3]);
+        else if ((buf[i] & 0x0f) != 0x0f)
+            result->serial_to_usb.errors++;
+    }
+}
+
+static bool
+usb_offer_out (void)
+{
+    stream_t *s = &result->usb_to_serial;
+    uint8_t event[4] = { 0x09, 0x90, seq_note(s->sent), seq_velocity(s->sent) };
+    uint32_t n = sizeof(event);
+
+    if (usb_io(AVR_IOCTL_USB_WRITE, OUT_EPNUM, event, &n) != AVR_IOCTL_USB_OK) {
+        result->naks++;
+        return false;
+    }
+    s->sent++;
+    result->accepted++;
+    return true;
+}
+
+static void
+boot (const char *firmware)
+{
+    elf_firmware_t f;
+    uint32_t flags = 0;
+
+    memset(&f, 0, sizeof(f));
+    if (elf_read_firmware(firmware, &f)) {
+        fprintf(stderr, "cannot read %s\n", firmware);
+        exit(2);
+    }
+    avr = avr_make_mcu_by_name("at90usb162");
+    if (!avr) {
+        fprintf(stderr, "simavr has no at90usb162 core\n");
+        exit(2);
+    }
+    avr_init(avr);
+    avr_load_firmware(avr, &f);
+    avr->frequency = F_CPU;
+
+    avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('1'), &flags);
+    flags &= ~AVR_UART_FLAG_STDIO;
+    avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('1'), &flags);
+    uart_in = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('1'), UART_IRQ_INPUT);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('1'), UART_IRQ_OUTPUT),
+                            serial_out, NULL);
+
+    avr_ioctl(avr, AVR_IOCTL_USB_VBUS, (void *)1);
+    run_usec(100000);
+    avr_ioctl(avr, AVR_IOCTL_USB_RESET, NULL);
+    run_usec(10000);
+
+    if (usb_control(0x00, 0x05, 1, 0, NULL, 0) < 0       /* SET_ADDRESS */
+        || usb_control(0x00, 0x09, 1, 0, NULL, 0) < 0) { /* SET_CONFIGURATION */
+        fprintf(stderr, "enumeration failed\n");
+        exit(2);
+    }
+    run_usec(10000);
+}
+
+/* Runs one load step of load / STEP OUT events per frame. */
+static void
+run_step (const char *firmware, unsigned load, unsigned seconds, result_t *r)
+{
+    unsigned frames = seconds * 1000;
+    unsigned credit = 0;
+
+    memset(r, 0, sizeof(*r));
+    result = r;
+    tx_status = tx_pos = feed_pos = 0;
+
+    boot(firmware);
+
+    feeding = true;
+    avr_cycle_timer_register_usec(avr, BYTE_USEC, serial_feed, NULL);
+
+    for (unsigned frame = 0; frame < frames + DRAIN_FRAMES; frame++) {
+        /* Packets the device NAKed stay queued for the next slot, in this
+         * frame or a later one. Once the load is off, whatever is still
+         * queued is left unsent, so the device can drain. */
+        if (frame < frames) {
+            for (credit += load; credit >= STEP; credit -= STEP) {
+                r->offered++;
+                r->queued++;
+            }
+        } else if (frame == frames) {
+            feeding = false;
+            r->saturated = r->queued > (load + STEP - 1) / STEP;
+            r->queued = 0;
+        }
+
+        /* Each slot is one bus transaction time: the host offers an OUT
+         * packet while it has one queued, then polls IN. */
+        for (unsigned slot = 0; slot < SLOTS; slot++) {
+            if (r->queued && usb_offer_out())
+                r->queued--;
+            usb_poll_in();
+            run_usec(1000 / SLOTS);
+        }
+    }
+
+    if (usb_control(0xc0, REQ_LOSSES, 0, 0, (uint8_t *)&r->losses, sizeof(r->losses))
+        != sizeof(r->losses)) {
+        fprintf(stderr, "REQ_GetLossCounters failed\n");
+        exit(2);
+    }
+
+    r->lossless = r->serial_to_usb.received == r->serial_to_usb.sent
+        && r->usb_to_serial.received == r->usb_to_serial.sent
+        && !r->serial_to_usb.errors && !r->usb_to_serial.errors
+        && !r->losses.SerialOverruns && !r->losses.SerialFrameErrors
+        && !r->losses.USBPackets;
+
+    avr_terminate(avr);
+}
+
+static void
+usage (const char *name)
+{
+    fprintf(stderr, "usage: %s [-s seconds] [-m max-per-frame] MIDI.elf\n", name);
+    exit(2);
+}
+
+int
+main (int argc, char **argv)
+{
+    unsigned seconds = 2, max = SLOTS;
+    int sustained = -1, saturation = -1, first_loss = -1;
+    double sustained_rate = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:m:")) != -1) {
+        switch (opt) {
+        case 's': seconds = atoi(optarg); break;
+        case 'm': max = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || !seconds || !max || max > SLOTS)
+        usage(argv[0]);
+
+    printf("%6s %9s %9s %9s %9s %9s %5s %5s %5s  %s\n",
+           "offer", "accepted", "naks", "rx->in/s", "in lost", "out lost",
+           "ovr", "ferr", "usb", "result");
+
+    /* Past saturation the accepted rate stays put and only the NAKs grow,
+     * so the sweep stops at twice the saturating load. */
+    for (unsigned load = 1; load <= max * STEP; load++) {
+        double offered, accepted;
+        result_t r;
+
+        if (saturation > 0 && load > 2 * (unsigned)saturation)
+            break;
+
+        run_step(argv[optind], load, seconds, &r);
+        offered = (double)load / STEP;
+        accepted = (double)r.accepted / (seconds * 1000);
+
+        printf("%6.3f %9.3f %9u %9.0f %9ld %9ld %5u %5u %5u  %s\n",
+               offered, accepted, r.naks,
+               (double)r.serial_to_usb.received / seconds,
+               (long)r.serial_to_usb.sent - r.serial_to_usb.received + r.serial_to_usb.errors,
+               (long)r.usb_to_serial.sent - r.usb_to_serial.received + r.usb_to_serial.errors,
+               r.losses.SerialOverruns, r.losses.SerialFrameErrors, r.losses.USBPackets,
+               !r.lossless ? "LOSS" : r.saturated ? "saturated" : "ok");
+
+        if (!r.lossless && first_loss < 0)
+            first_loss = load;
+        if (r.saturated && saturation < 0)
+            saturation = load;
+        if (r.lossless && !r.saturated && saturation < 0 && first_loss < 0) {
+            sustained = load;
+            sustained_rate = (double)r.accepted / seconds;
+        }
+    }
+
+    if (sustained < 0)
+        printf("\nno sustained load: saturated or lossy at %.3f OUT events per frame\n",
+               1.0 / STEP);
+    else
+        printf("\nhighest sustained load: %.3f OUT events per frame (%.0f events/s accepted)"
+               " with serial RX at line rate\n", (double)sustained / STEP, sustained_rate);
+    if (saturation > 0)
+        printf("saturates at: %.3f OUT events per frame\n", (double)saturation / STEP);
+    if (first_loss > 0)
+        printf("loss begins at: %.3f OUT events per frame\n", (double)first_loss / STEP);
+    else
+        printf("no loss up to the highest load tried\n");
+
+    return first_loss > 0;
+}